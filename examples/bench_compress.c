@@ -0,0 +1,129 @@
+/*
+ * Finds where compressing request bodies starts to pay off.
+ *
+ * For a range of document sizes this PUTs the same document with and without
+ * PT_OPT_GZIP_MIN_SIZE and prints the average time per write along with how
+ * much smaller the gzipped body is.  Against a couch on localhost the network
+ * is practically free, so the last column estimates the crossover instead:
+ * the bits saved divided by the time it takes to compress them.  Links slower
+ * than that are better off compressed.
+ *
+ *   bench_compress [database url] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <zlib.h>
+
+#include "pillowtalk.h"
+
+static double now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static pt_node_t* make_item(int i)
+{
+  pt_node_t* item = pt_map_new();
+  pt_map_set(item,"name",pt_string_new("widget"));
+  pt_map_set(item,"sku",pt_integer_new(100000 + i * 7));
+  pt_map_set(item,"price",pt_double_new(i * 0.25));
+  pt_map_set(item,"in_stock",pt_bool_new(i % 3));
+  return item;
+}
+
+/* A document of roughly size bytes that looks like a list of records */
+static char* make_doc(size_t size)
+{
+  pt_node_t* sample = make_item(1);
+  char* one = pt_to_json(sample,0);
+  size_t per_item = strlen(one) + 1;
+  size_t i, n = size / per_item;
+  free(one);
+  pt_free_node(sample);
+
+  pt_node_t* doc = pt_map_new();
+  pt_node_t* items = pt_array_new();
+  pt_map_set(doc,"items",items);
+  for(i = 0; i <= n; i++)
+    pt_array_push_back(items,make_item(i));
+  char* json = pt_to_json(doc,0);
+  pt_free_node(doc);
+  return json;
+}
+
+static double time_puts(pt_session_t* session, const char* url, const char* json, int iterations)
+{
+  int i;
+  double start = now_ms();
+  for(i = 0; i < iterations; i++) {
+    // fetch the current revision so every PUT is a successful update
+    pt_response_t* res = pt_session_get(session,url);
+    pt_node_t* rev = res->root ? pt_map_get(res->root,"_rev") : NULL;
+    char* body = (char*) malloc(strlen(json) + 128);
+    if (rev && pt_string_get(rev))
+      sprintf(body,"{\"_rev\":\"%s\",%s",pt_string_get(rev),json + 1);
+    else
+      strcpy(body,json);
+    pt_free_response(res);
+
+    res = pt_session_put_raw(session,url,body,strlen(body));
+    if (res->response_code != 201 && res->response_code != 200)
+      fprintf(stderr,"PUT %s returned %ld\n",url,res->response_code);
+    pt_free_response(res);
+    free(body);
+  }
+  return (now_ms() - start) / iterations;
+}
+
+int main(int argc, char** argv)
+{
+  const char* database = argc > 1 ? argv[1] : "http://localhost:5984/pillowtalk_bench";
+  int iterations = argc > 2 ? atoi(argv[2]) : 20;
+  size_t sizes[] = {256,1024,4096,16384,65536,262144,1048576,4194304};
+  unsigned int i;
+  char url[1024];
+
+  pt_init();
+  pt_free_response(pt_put_raw(database,NULL,0));
+
+  pt_session_t* plain = pt_session_new(1);
+  pt_session_t* gzip = pt_session_new(1);
+  pt_session_setopt(gzip,PT_OPT_GZIP_MIN_SIZE,1);
+
+  printf("%10s %10s %10s %10s %10s %16s\n","bytes","gzipped","ratio","plain ms","gzip ms","break-even Mbit/s");
+  for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    char* json = make_doc(sizes[i]);
+    size_t len = strlen(json);
+
+    // the library compresses at Z_BEST_SPEED, so time the same thing here
+    uLongf zlen = 0;
+    Bytef* zbuf = (Bytef*) malloc(compressBound(len));
+    int j;
+    double start = now_ms();
+    for(j = 0; j < iterations; j++) {
+      zlen = compressBound(len);
+      compress2(zbuf,&zlen,(const Bytef*) json,len,Z_BEST_SPEED);
+    }
+    double compress_ms = (now_ms() - start) / iterations;
+    free(zbuf);
+
+    snprintf(url,sizeof(url),"%s/plain_%lu",database,(unsigned long) sizes[i]);
+    double plain_ms = time_puts(plain,url,json,iterations);
+    snprintf(url,sizeof(url),"%s/gzip_%lu",database,(unsigned long) sizes[i]);
+    double gzip_ms = time_puts(gzip,url,json,iterations);
+
+    printf("%10lu %10lu %10.2f %10.3f %10.3f %16.1f\n",(unsigned long) len,(unsigned long) zlen,
+           (double) len / zlen,plain_ms,gzip_ms,(len - zlen) * 8.0 / (compress_ms * 1000.0));
+    free(json);
+  }
+
+  pt_session_free(plain);
+  pt_session_free(gzip);
+  pt_free_response(pt_delete(database));
+  pt_cleanup();
+  return 0;
+}
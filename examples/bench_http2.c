@@ -0,0 +1,85 @@
+/*
+ * Compares HTTP/1.1 keep-alive against HTTP/2 multiplexing for a burst of
+ * concurrent GETs to one server.
+ *
+ * The same number of requests is pushed through a session's async queue with
+ * PT_OPT_MAX_INFLIGHT concurrency, once per HTTP version, and the throughput
+ * and number of connections opened are printed for each.  HTTP/1.1 needs a
+ * connection per in flight request while HTTP/2 should get by with one.
+ * http:// urls use h2c with prior knowledge, so the server has to support it;
+ * nghttpd --no-tls works for trying this out locally.
+ *
+ *   bench_http2 url [requests] [concurrency]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "pillowtalk.h"
+
+static double now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static void count_response(pt_response_t* res, void* userdata)
+{
+  int* failures = (int*) userdata;
+  if (res->response_code != 200)
+    (*failures)++;
+  pt_free_response(res);
+}
+
+static void run(const char* name, pt_http_version_t version, const char* url, int requests, int concurrency)
+{
+  int i, failures = 0;
+  pt_session_t* session = pt_session_new(concurrency);
+  pt_session_setopt(session,PT_OPT_MAX_INFLIGHT,concurrency);
+  pt_session_setopt(session,PT_OPT_MAX_CONNECTIONS,concurrency);
+  pt_session_setopt(session,PT_OPT_HTTP_VERSION,version);
+
+  pt_metrics_t* before = pt_metrics_snapshot();
+  double start = now_ms();
+  for(i = 0; i < requests; i++)
+    pt_async_get(session,url,count_response,&failures);
+  pt_session_wait(session);
+  double elapsed = now_ms() - start;
+  pt_metrics_t* after = pt_metrics_snapshot();
+
+  // just this run's latencies
+  pt_histogram_t latency = after->histograms[PT_METRIC_GET];
+  for(i = 0; i < PT_HISTOGRAM_BUCKETS; i++)
+    latency.buckets[i] -= before->histograms[PT_METRIC_GET].buckets[i];
+
+  printf("%-10s %10.0f req/s %8.1f ms p99 %6llu connections %6d failed\n",name,
+         requests / (elapsed / 1000.0),
+         pt_histogram_percentile(&latency,99) / 1000.0,
+         after->counters[PT_COUNTER_CONNECTIONS_OPENED] - before->counters[PT_COUNTER_CONNECTIONS_OPENED],
+         failures);
+
+  pt_free_metrics(before);
+  pt_free_metrics(after);
+  pt_session_free(session);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr,"usage: %s url [requests] [concurrency]\n",argv[0]);
+    return 1;
+  }
+  const char* url = argv[1];
+  int requests = argc > 2 ? atoi(argv[2]) : 2000;
+  int concurrency = argc > 3 ? atoi(argv[3]) : 32;
+  int tls = !strncmp(url,"https:",6);
+
+  pt_init();
+  pt_metrics_enable(1);
+  run("HTTP/1.1",PT_HTTP_1_1,url,requests,concurrency);
+  run(tls ? "HTTP/2" : "h2c",tls ? PT_HTTP_2 : PT_HTTP_2_PRIOR_KNOWLEDGE,url,requests,concurrency);
+  pt_cleanup();
+  return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Compares loopback TCP against a Unix domain socket for small requests to a
+ * server on the same host.
+ *
+ * A stand-in server answering every GET with a small json document listens
+ * on both 127.0.0.1 and a socket in /tmp, and the same number of sequential
+ * GETs goes over each from one session, so connection setup is paid once and
+ * what's left is the per-request cost of the transport.  Prints the mean and
+ * percentiles of the request times and the throughput for each.
+ *
+ *   bench_unix_socket [requests]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "pillowtalk.h"
+
+static const char* body = "{\"_id\":\"doc\",\"_rev\":\"1-abc\",\"value\":[1,2,3]}";
+
+static double now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/* Answer each request on a keep-alive connection with the same document */
+static void* serve(void* data)
+{
+  int fd = (int) (long) data;
+  char response[256], buf[4096];
+  int response_len = snprintf(response,sizeof(response),
+      "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n%s",
+      (int) strlen(body),body);
+  size_t pending = 0;
+  ssize_t n;
+  while ((n = read(fd,buf + pending,sizeof(buf) - pending - 1)) > 0) {
+    char* end;
+    pending += n;
+    buf[pending] = '\0';
+    // GETs have no body, so each blank line ends a request
+    while ((end = strstr(buf,"\r\n\r\n"))) {
+      size_t used = end + 4 - buf;
+      memmove(buf,buf + used,pending - used + 1);
+      pending -= used;
+      if (write(fd,response,response_len) != response_len)
+        break;
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+static void* accept_loop(void* data)
+{
+  int listener = (int) (long) data;
+  int fd;
+  while ((fd = accept(listener,NULL,NULL)) >= 0) {
+    pthread_t conn;
+    pthread_create(&conn,NULL,serve,(void*) (long) fd);
+    pthread_detach(conn);
+  }
+  return NULL;
+}
+
+static void listen_on(int listener)
+{
+  pthread_t acceptor;
+  listen(listener,16);
+  pthread_create(&acceptor,NULL,accept_loop,(void*) (long) listener);
+  pthread_detach(acceptor);
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+  double x = *(const double*) a, y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+static void run(const char* name, const char* url, const char* unix_socket, int requests)
+{
+  int i, failures = 0;
+  double* times = (double*) malloc(requests * sizeof(double));
+  double total = 0;
+  pt_session_t* session = pt_session_new(1);
+  if (unix_socket)
+    pt_session_set_unix_socket(session,unix_socket);
+
+  // the first request pays for the connection
+  pt_free_response(pt_session_get(session,url));
+  double start = now_ms();
+  for(i = 0; i < requests; i++) {
+    pt_response_t* res = pt_session_get(session,url);
+    if (res->response_code != 200)
+      failures++;
+    times[i] = res->timing.total * 1e6;
+    total += times[i];
+    pt_free_response(res);
+  }
+  double elapsed = now_ms() - start;
+  qsort(times,requests,sizeof(double),compare_doubles);
+
+  printf("%-6s %10.0f req/s %8.1f us mean %8.1f us p50 %8.1f us p99 %6d failed\n",name,
+         requests / (elapsed / 1000.0),total / requests,
+         times[requests / 2],times[(int) (requests * 0.99)],failures);
+  free(times);
+  pt_session_free(session);
+}
+
+int main(int argc, char** argv)
+{
+  int requests = argc > 1 ? atoi(argv[1]) : 20000;
+  char url[64], path[64];
+  if (requests < 1)
+    requests = 1;
+
+  int tcp = socket(AF_INET,SOCK_STREAM,0);
+  struct sockaddr_in in_addr;
+  memset(&in_addr,0,sizeof(in_addr));
+  in_addr.sin_family = AF_INET;
+  in_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(in_addr);
+  if (bind(tcp,(struct sockaddr*) &in_addr,sizeof(in_addr)) || getsockname(tcp,(struct sockaddr*) &in_addr,&len)) {
+    perror("bind");
+    return 1;
+  }
+  listen_on(tcp);
+  snprintf(url,sizeof(url),"http://127.0.0.1:%d/db/doc",ntohs(in_addr.sin_port));
+
+  int local = socket(AF_UNIX,SOCK_STREAM,0);
+  struct sockaddr_un un_addr;
+  memset(&un_addr,0,sizeof(un_addr));
+  un_addr.sun_family = AF_UNIX;
+  snprintf(path,sizeof(path),"/tmp/bench_unix_socket_%d.sock",(int) getpid());
+  strcpy(un_addr.sun_path,path);
+  if (bind(local,(struct sockaddr*) &un_addr,sizeof(un_addr))) {
+    perror("bind");
+    return 1;
+  }
+  listen_on(local);
+
+  pt_init();
+  run("tcp",url,NULL,requests);
+  run("unix",url,path,requests);
+  pt_cleanup();
+  unlink(path);
+  return 0;
+}
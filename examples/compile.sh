@@ -1 +1,4 @@
 gcc -lpillowtalk -o basic basic.c
+gcc -o bench_compress bench_compress.c -lpillowtalk -lz
+gcc -o bench_http2 bench_http2.c -lpillowtalk
+gcc -o bench_unix_socket bench_unix_socket.c -lpillowtalk -lpthread
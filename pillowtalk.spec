@@ -1,7 +1,7 @@
 Name: pillowtalk
-Version: 0.3
+Version: 0.4
 Summary: ANSI C library that talks to CouchDB using libcurl and yajl
-Release: 2
+Release: 1
 Source: %{name}-%{version}.tgz
 
 License: MIT-LICENSE
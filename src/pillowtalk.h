@@ -12,22 +12,283 @@ typedef enum {PT_MAP,PT_ARRAY,PT_NULL, PT_BOOLEAN, PT_INTEGER, PT_DOUBLE, PT_STR
 
 typedef struct {
   pt_type_t type;
+  unsigned int flags; /* pillowtalk's own bookkeeping, leave it alone */
 } pt_node_t;
 
+/*
+ * Where the time for a request went.  The curl times are in seconds counted
+ * from the start of the request, so starttransfer - pretransfer is roughly
+ * the server's think time.  parse and serialize are the time pillowtalk
+ * spent turning json into nodes and back, and byte counts include headers.
+ */
+typedef struct {
+  double namelookup;
+  double connect;
+  double pretransfer;
+  double starttransfer;
+  double total;
+  double parse;
+  double serialize;
+  long long bytes_sent;
+  long long bytes_received;
+} pt_timing_t;
+
 typedef struct {
   pt_node_t* root;
   long response_code;
   char* raw_json;
   int raw_json_len;
+  pt_timing_t timing;
 } pt_response_t;
 
 // Opaque type for iterator
 typedef struct {
 } pt_iterator_t;
 
+// Opaque type for an interned map key, see pt_key_intern
+typedef struct {
+} pt_key_t;
+
+// Opaque type for a session of pooled connections
+typedef struct {
+} pt_session_t;
+
+// Opaque type for a request started with one of the pt_async_* calls
+typedef struct {
+} pt_async_t;
+
+/*
+ * Called once an asynchronous request completes.  The callback owns the
+ * response and has to pt_free_response it.
+ */
+typedef void (*pt_async_callback)(pt_response_t* response, void* userdata);
+
+/* One entry of a pt_bulk_get result */
+typedef struct {
+  const char* id;
+  pt_node_t* doc;       /* NULL if the document couldn't be fetched */
+  const char* error;    /* NULL on success, otherwise "not_found", "deleted", ...;
+                           never NULL when doc is */
+} pt_bulk_doc_t;
+
+typedef struct {
+  long response_code;
+  unsigned int len;
+  pt_bulk_doc_t* docs;
+  pt_response_t* response; /* owns the doc nodes */
+} pt_bulk_get_result_t;
+
+// Opaque type for a buffering _bulk_docs writer
+typedef struct {
+} pt_bulk_writer_t;
+
+/*
+ * Called once per document when a pt_bulk_writer_t flushes.  On success rev
+ * is the new revision and error is NULL; otherwise error says why the doc
+ * wasn't saved, e.g. "conflict".  id may be NULL if the server never
+ * assigned one.
+ */
+typedef void (*pt_bulk_write_callback)(const char* id, const char* rev, const char* error, void* userdata);
+
+/* Settings for pt_changes_follow, a zeroed struct gives the defaults */
+typedef struct {
+  int longpoll;           /* use feed=longpoll instead of feed=continuous */
+  int include_docs;       /* include the changed documents */
+  int heartbeat_ms;       /* server heartbeat interval, 30000 if 0 */
+  const char* filter;     /* optional filter function, e.g. "app/important" */
+  int max_reconnects;     /* failures in a row before giving up, 0 never, -1 no reconnects */
+} pt_changes_opts_t;
+
+/*
+ * Called for every change with the parsed change object, which is freed
+ * once the callback returns.  Return nonzero to stop following the feed.
+ */
+typedef int (*pt_changes_callback)(pt_node_t* change, void* userdata);
+
+// Opaque type for a view being read a row at a time
+typedef struct {
+} pt_view_t;
+
+/*
+ * Called with each row of a streamed view.  The callback owns the row and
+ * has to pt_free_node it.  Return nonzero to stop reading the view.
+ */
+typedef int (*pt_view_callback)(pt_node_t* row, void* userdata);
+
+/*
+ * Latencies are kept in microseconds in log-linear buckets, HDR histogram
+ * style: exact below 16us and then 16 buckets per power of two, so every
+ * value is known to within about 6%.  Anything over 2^41us lands in the top
+ * bucket.
+ */
+#define PT_HISTOGRAM_BUCKETS 608
+
+typedef struct {
+  unsigned long long count;
+  unsigned long long total_us;
+  unsigned long long min_us;
+  unsigned long long max_us;
+  unsigned long long buckets[PT_HISTOGRAM_BUCKETS];
+} pt_histogram_t;
+
+/* What the library keeps latency histograms for */
+typedef enum {
+  PT_METRIC_GET,
+  PT_METRIC_PUT,
+  PT_METRIC_POST,
+  PT_METRIC_DELETE,
+  PT_METRIC_OTHER_METHOD,
+  PT_METRIC_PARSE,     /* json text to nodes */
+  PT_METRIC_GENERATE,  /* nodes to json text, pt_to_json */
+  PT_METRIC_CLONE,     /* pt_clone */
+  PT_METRIC_MERGE,     /* pt_map_update */
+  PT_METRIC_COUNT
+} pt_metric_t;
+
+typedef enum {
+  PT_COUNTER_REQUESTS,
+  PT_COUNTER_ERRORS,              /* transport failures and 5xx responses */
+  PT_COUNTER_RETRIES,
+  PT_COUNTER_BYTES_SENT,
+  PT_COUNTER_BYTES_RECEIVED,
+  PT_COUNTER_CONNECTIONS_OPENED,
+  PT_COUNTER_CONNECTIONS_REUSED,
+  PT_COUNTER_HEDGES,              /* second copies of slow GETs sent */
+  PT_COUNTER_CACHE_HITS,          /* GETs answered 304 and served from the cache */
+  PT_COUNTER_CACHE_MISSES,        /* cacheable GETs that had to download the body */
+  PT_COUNTER_COALESCED,           /* GETs that waited on an identical one instead of going out */
+  PT_COUNTER_COUNT
+} pt_counter_t;
+
+typedef struct {
+  pt_histogram_t histograms[PT_METRIC_COUNT];
+  unsigned long long counters[PT_COUNTER_COUNT];
+} pt_metrics_t;
+
+typedef enum {
+  PT_OPT_MAX_INFLIGHT,    /* max concurrent async requests, 0 for no limit */
+  PT_OPT_STREAM_PARSE,    /* parse response bodies while they download */
+  PT_OPT_RETAIN_RAW_JSON, /* keep raw_json when stream parsing, defaults to 1 */
+  PT_OPT_ACCEPT_ENCODING, /* ask for gzip/deflate responses, decoded on the fly */
+  PT_OPT_GZIP_MIN_SIZE,   /* gzip PUT/POST bodies of at least this many bytes, 0 is off */
+  PT_OPT_BUFFER_POOL,     /* keep this many freed response buffers for reuse, 0 is off */
+  PT_OPT_MAX_CONNECTIONS, /* idle connections each pooled handle keeps open, default 32 */
+  PT_OPT_HTTP_VERSION,    /* one of pt_http_version_t */
+  PT_OPT_TIMEOUT_MS,      /* give up on a request after this long, retries included, 0 for never */
+  PT_OPT_CONNECT_TIMEOUT_MS, /* give up connecting after this long, default 10000 */
+  PT_OPT_RETRIES,         /* times a failed GET is tried again, default 0 */
+  PT_OPT_RETRY_BACKOFF_MS, /* base delay before a retry, doubled each time, default 100 */
+  PT_OPT_HEDGE_PERCENTILE, /* resend GETs slower than this percentile of recent ones, 0 is off */
+  PT_OPT_CACHE_BYTES,     /* memory for cached GET responses, 0 is off */
+  PT_OPT_COALESCE_GETS,   /* threads GETting the same url at once share one request */
+  PT_OPT_ARENA_PARSE,     /* parsed trees live in an arena freed with the response */
+  PT_OPT_IN_SITU_STRINGS, /* strings point into the response body, see below */
+  PT_OPT_INTERN_KEYS      /* parsed map keys share interned copies, see pt_key_intern */
+} pt_session_option_t;
+
+/*
+ * Only GETs are retried or hedged: CouchDB answers a PUT or DELETE that is
+ * replayed after it went through with a conflict, so those are left alone.
+ * A GET is retried when it couldn't connect, timed out, the connection
+ * dropped, or the server answered 502, 503 or 504.  Each wait is a random
+ * time up to the backoff doubled per attempt, so clients that failed
+ * together don't all come back at once, and no retry is made that would
+ * run past PT_OPT_TIMEOUT_MS.
+ *
+ * With hedging on, a GET still running after the given percentile of the
+ * session's recent GET times gets a second copy sent, and whichever answers
+ * first is the response.  That trades a few percent more requests for not
+ * waiting on the odd slow server.  Streamed views and change feeds are never
+ * retried or hedged.
+ */
+
+/*
+ * With PT_OPT_CACHE_BYTES set, parsed GET responses that came with an ETag
+ * are kept, least recently used first out once the budget is spent.  The
+ * next GET of the same url sends If-None-Match, and when the server answers
+ * 304 the response gets a copy of the cached tree and a 200, without the
+ * body going over the wire or being parsed again.  Those responses have no
+ * raw_json.  A PUT or DELETE through the session drops its url from the
+ * cache.
+ */
+
+/*
+ * With PT_OPT_COALESCE_GETS on, a blocking GET of a url that another thread
+ * is already fetching through the session waits for that request instead of
+ * making its own, so a burst of readers after a hot document changes costs
+ * one round trip and one parse.  Everyone gets their own copy of the tree.
+ * Async GETs are not coalesced.
+ */
+
+/*
+ * With PT_OPT_ARENA_PARSE on, the tree of a parsed response is carved out of
+ * a few large blocks owned by the response instead of allocated node by
+ * node, and pt_free_response hands the blocks back without walking it.  The
+ * tree lives exactly as long as its response and is read only: pt_free_node
+ * on any part of it does nothing, and pt_map_set, pt_map_unset,
+ * pt_array_push_*, pt_array_remove and pt_map_update change nothing, log a
+ * warning and leave the node they were given with the caller.
+ * pt_map_update also returns nonzero.  pt_is_read_only tells such trees
+ * apart, and pt_clone makes an ordinary copy to change or keep.  Rows of
+ * streamed views are the callback's to keep, so those are always allocated
+ * normally.
+ */
+
+/*
+ * With PT_OPT_IN_SITU_STRINGS on, the strings and keys of a parsed response
+ * aren't copied out of the body: each is ended in place where its closing
+ * quote was, and escaped ones are decoded over themselves.  That changes the
+ * body, so those responses have no raw_json, and the tree must not outlive
+ * its response; pt_clone one that has to.  Only bodies parsed once they
+ * have fully arrived are done this way, not PT_OPT_STREAM_PARSE ones.
+ */
+
+/*
+ * With PT_OPT_INTERN_KEYS on, the map keys of parsed responses aren't copied
+ * per map: documents from one database share a handful of field names, and
+ * each is kept once for the life of the process, along with its hash.  The
+ * first few thousand distinct keys seen are interned and any after that are
+ * copied as usual.  Keys interned this way take precedence over
+ * PT_OPT_IN_SITU_STRINGS ones.
+ */
+
+/*
+ * With HTTP/2 a session's concurrent requests to a server are multiplexed
+ * over one connection instead of each taking its own.  PT_HTTP_2 negotiates
+ * it over TLS and sticks to HTTP/1.1 otherwise; PT_HTTP_2_PRIOR_KNOWLEDGE
+ * speaks it straight away, for plain http servers known to support h2c.
+ */
+typedef enum {
+  PT_HTTP_DEFAULT,
+  PT_HTTP_1_1,
+  PT_HTTP_2,
+  PT_HTTP_2_PRIOR_KNOWLEDGE
+} pt_http_version_t;
+
 void pt_init();
 void pt_cleanup();
 
+/***** Logging Functions ******/
+
+typedef enum {
+  PT_LOG_OFF,
+  PT_LOG_ERROR,
+  PT_LOG_WARN,   /* failed requests, malformed json */
+  PT_LOG_INFO,
+  PT_LOG_DEBUG   /* every request made */
+} pt_log_level_t;
+
+typedef void (*pt_log_callback)(pt_log_level_t level, const char* message, void* userdata);
+
+/*
+ * Logging is off until this is called.  Messages at level or more severe go
+ * to sink, or to stderr if sink is NULL.  While a level is disabled the check
+ * is a single load; building with -DPT_LOG_MAX_LEVEL=0 removes logging from
+ * the library entirely.  Set the sink up before other threads start making
+ * requests.
+ */
+void pt_set_log(pt_log_level_t level, pt_log_callback sink, void* userdata);
+
 void pt_free_node(pt_node_t* node);
 void pt_free_response(pt_response_t* res);
 
@@ -38,6 +299,13 @@ pt_response_t* pt_delete(const char* server_target);
 pt_response_t* pt_put(const char* server_target, pt_node_t* document);
 pt_response_t* pt_put_raw(const char* server_target, const char* data, unsigned int data_len);
 
+/*
+ * POST a json body, e.g. to a database to create a document with a server
+ * generated id.  Like pt_put_raw the body is sent straight from data without
+ * being copied, with its length given as the Content-Length.
+ */
+pt_response_t* pt_post_raw(const char* server_target, const char* data, unsigned int data_len);
+
 /* 
  * Do an HTTP get request on the target and parse the resulting JSON into the
  * pt_response object
@@ -51,6 +319,202 @@ pt_response_t* pt_get(const char* server_target);
  */
 pt_response_t* pt_unparsed_get(const char* server_target);
 
+/***** Session Related Functions ******/
+
+/*
+ * A session keeps finished curl handles around, keyed by the host they last
+ * talked to, so that later requests to the same host go out over the warm
+ * keep-alive connection instead of paying for a DNS lookup and TCP handshake
+ * every time.  At most max_pool_size idle handles are kept; the least
+ * recently used one is closed when the pool is full.
+ *
+ * Sessions are thread safe: any number of threads can make blocking calls
+ * on one session at once.  They share its DNS cache and TLS sessions, so a
+ * worker pool only resolves once per host and resumes TLS instead of doing a
+ * full handshake.  Connections aren't shared, but each thread gets back the
+ * pooled handle it used last, and with it that handle's open connection.
+ * The pt_async_* calls and pt_session_perform/wait, and pt_session_setopt,
+ * still have to stay on one thread.  Call pt_init before starting threads.
+ */
+pt_session_t* pt_session_new(unsigned int max_pool_size);
+void pt_session_free(pt_session_t* session);
+
+/*
+ * These behave exactly like their pt_* counterparts but run over the
+ * session's pooled connections.  Passing a NULL session is the same as
+ * calling the plain version.
+ */
+pt_response_t* pt_session_get(pt_session_t* session, const char* server_target);
+pt_response_t* pt_session_unparsed_get(pt_session_t* session, const char* server_target);
+pt_response_t* pt_session_put(pt_session_t* session, const char* server_target, pt_node_t* document);
+pt_response_t* pt_session_put_raw(pt_session_t* session, const char* server_target, const char* data, unsigned int data_len);
+pt_response_t* pt_session_post_raw(pt_session_t* session, const char* server_target, const char* data, unsigned int data_len);
+pt_response_t* pt_session_delete(pt_session_t* session, const char* server_target);
+
+/*
+ * Change a session setting.  Returns nonzero if the option is unknown.
+ */
+int pt_session_setopt(pt_session_t* session, pt_session_option_t option, long value);
+
+/*
+ * Send the session's requests over the Unix domain socket at path instead of
+ * TCP, for a CouchDB or proxy on the same host.  URLs stay as they are and
+ * still supply the Host header and path, but the host is never looked up or
+ * connected to.  NULL goes back to TCP.  Requests already under way keep
+ * the path they started with.
+ */
+int pt_session_set_unix_socket(pt_session_t* session, const char* path);
+
+/***** Asynchronous Functions ******/
+
+/*
+ * Start a request on the session without blocking.  Nothing goes over the
+ * wire until pt_session_perform is called, and the callback is invoked from
+ * inside pt_session_perform when the request finishes.  Requests over the
+ * PT_OPT_MAX_INFLIGHT limit wait in a queue until a slot frees up.
+ *
+ * The returned handle is only valid until the callback has been called.
+ */
+pt_async_t* pt_async_get(pt_session_t* session, const char* server_target, pt_async_callback callback, void* userdata);
+pt_async_t* pt_async_put(pt_session_t* session, const char* server_target, pt_node_t* document, pt_async_callback callback, void* userdata);
+pt_async_t* pt_async_delete(pt_session_t* session, const char* server_target, pt_async_callback callback, void* userdata);
+
+/*
+ * Abort a request that hasn't completed yet.  Its callback will not be
+ * called.
+ */
+void pt_async_cancel(pt_session_t* session, pt_async_t* async);
+
+/*
+ * Drive the session's outstanding requests, waiting up to timeout_ms for
+ * network activity, and fire the callbacks of any that finished.  Returns
+ * the number of requests still queued or in flight.
+ */
+int pt_session_perform(pt_session_t* session, int timeout_ms);
+
+/*
+ * Keep calling pt_session_perform until every request has completed
+ */
+void pt_session_wait(pt_session_t* session);
+
+/***** Bulk Functions ******/
+
+/*
+ * Fetch n documents from a database in a single request by POSTing their ids
+ * to _all_docs?include_docs=true.  docs[i] of the result holds the document
+ * for ids[i], or the reason it couldn't be read.  The ids must stay valid
+ * for the lifetime of the result.  session may be NULL.
+ */
+pt_bulk_get_result_t* pt_bulk_get(pt_session_t* session, const char* database_target, const char** ids, unsigned int n);
+void pt_free_bulk_get_result(pt_bulk_get_result_t* result);
+
+/*
+ * A bulk writer serializes documents as they are added and sends them to
+ * the database's _bulk_docs in one request once max_docs documents or
+ * max_bytes of json have been buffered, or max_delay_ms has passed since the
+ * first document of the batch was added.  A limit of 0 turns that trigger
+ * off.  The deadline is only checked from pt_bulk_writer_add and
+ * pt_bulk_writer_poll, so call the latter periodically if writes are
+ * sporadic.
+ *
+ * Documents are serialized when added; the caller keeps ownership.
+ *
+ * pt_bulk_writer_add, pt_bulk_writer_poll and pt_bulk_writer_flush return
+ * nonzero if a flush they triggered failed as a whole.  pt_bulk_writer_free
+ * flushes whatever is left.
+ */
+pt_bulk_writer_t* pt_bulk_writer_new(pt_session_t* session, const char* database_target,
+    unsigned int max_docs, unsigned int max_bytes, unsigned int max_delay_ms,
+    pt_bulk_write_callback callback, void* userdata);
+int pt_bulk_writer_add(pt_bulk_writer_t* writer, pt_node_t* doc);
+int pt_bulk_writer_poll(pt_bulk_writer_t* writer);
+int pt_bulk_writer_flush(pt_bulk_writer_t* writer);
+void pt_bulk_writer_free(pt_bulk_writer_t* writer);
+
+/***** Changes Feed Functions ******/
+
+/*
+ * Follow a database's _changes feed starting after since ("0" or NULL for the
+ * beginning, "now" for only new changes), calling callback for each change
+ * as it arrives.  Each change is parsed on its own and freed right after the
+ * callback, so memory stays flat however long the feed runs.  If the
+ * connection drops the feed is reopened from the last seq seen, after a
+ * wait that doubles with each failure in a row up to 30 seconds.  An attempt
+ * that got any changes through before it dropped starts the count over, so
+ * only a feed that can't get anywhere gives up.
+ *
+ * This blocks until the callback returns nonzero, which makes it return 0,
+ * or until the server rejects the request or max_reconnects is exceeded, in
+ * which case the last response code is returned.  A seq too big for an int
+ * can't be resumed from, so one of those stops the feed before its change
+ * is handed out and returns -1.  opts may be NULL.
+ */
+int pt_changes_follow(pt_session_t* session, const char* database_target, const char* since,
+    const pt_changes_opts_t* opts, pt_changes_callback callback, void* userdata);
+
+/***** Streaming View Functions ******/
+
+/*
+ * Read a view (or _all_docs) without ever holding all of its rows in
+ * memory.  The {"rows":[...]} body is parsed as it downloads and each row is
+ * handed over as soon as it is complete, so processing overlaps with the
+ * transfer.
+ *
+ * pt_view_stream calls callback for every row and then returns the response
+ * with the rest of the envelope (total_rows, offset, or an error) in root.
+ */
+pt_response_t* pt_view_stream(pt_session_t* session, const char* view_target, pt_view_callback callback, void* userdata);
+
+/*
+ * The pull version: pt_view_next returns the next row, or NULL once the view
+ * is exhausted.  A row stays valid until the next call to pt_view_next or
+ * pt_view_close.  pt_view_close returns the response like pt_view_stream
+ * does.  It can be called early, but then the transfer is aborted and the
+ * response fails with a 500, whatever the server had answered.
+ */
+pt_view_t* pt_view_open(pt_session_t* session, const char* view_target);
+pt_node_t* pt_view_next(pt_view_t* view);
+pt_response_t* pt_view_close(pt_view_t* view);
+
+/***** Attachment Functions ******/
+
+/*
+ * Download an attachment straight into fd as it arrives, so memory use stays
+ * the same however big it is.  Only a successful body goes to fd; an error
+ * comes back parsed in the response as usual.  A failed write to fd aborts
+ * the transfer.  session may be NULL.
+ */
+pt_response_t* pt_attachment_get_to_fd(pt_session_t* session, const char* attachment_target, int fd);
+
+/*
+ * Upload everything from fd's current position to the end as an attachment.
+ * For a regular file the length is sent up front, anything else (a pipe, a
+ * socket) goes out chunked.  With use_mmap the file is mapped rather than
+ * read, which saves a copy per chunk for files already in the page cache;
+ * it falls back to reading when fd can't be mapped.  The attachment_target
+ * needs the document's current ?rev= like any other attachment PUT.
+ */
+pt_response_t* pt_attachment_put_from_fd(pt_session_t* session, const char* attachment_target, int fd,
+    const char* content_type, int use_mmap);
+
+/***** Metrics Functions ******/
+
+/*
+ * Metrics are off until pt_metrics_enable(1).  Each thread records into its
+ * own shard without taking any locks; pt_metrics_snapshot adds the shards up
+ * into a pt_metrics_t that has to be freed with pt_free_metrics.  Counts only
+ * ever go up, so diff two snapshots to get a rate.
+ */
+void pt_metrics_enable(int enabled);
+pt_metrics_t* pt_metrics_snapshot();
+void pt_free_metrics(pt_metrics_t* metrics);
+
+/*
+ * The latency in microseconds below which the given percentage (0-100) of the
+ * histogram's values fall, to within the bucket precision.
+ */
+unsigned long long pt_histogram_percentile(const pt_histogram_t* histogram, double percentile);
+
 /***** Node Related Functions ******/
 
 /*
@@ -60,10 +524,27 @@ pt_response_t* pt_unparsed_get(const char* server_target);
  */
 pt_node_t* pt_map_get(pt_node_t* map,const char* key);
 
+/*
+ * Intern a map key once and look it up by handle afterwards, which skips
+ * measuring and hashing it on every pt_map_get_k.  With PT_OPT_INTERN_KEYS
+ * on, the keys of parsed responses are the interned copies themselves, so
+ * finding one is a pointer comparison; keys of other maps are still found,
+ * just compared byte by byte.  Handles are never freed and stay good after
+ * pt_cleanup, so intern the fixed set of keys a program looks up, at
+ * startup or in statics, rather than one per lookup.  Returns NULL for keys
+ * over 128 bytes and once the intern table is full; look those up with
+ * pt_map_get instead.
+ */
+pt_key_t* pt_key_intern(const char* key);
+pt_node_t* pt_map_get_k(pt_node_t* map, const pt_key_t* key);
+
 unsigned int pt_array_len(pt_node_t* array);
 pt_node_t* pt_array_get(pt_node_t* array, unsigned int idx);
 
 int pt_is_null(pt_node_t* null);
+
+/* Nonzero for nodes of a PT_OPT_ARENA_PARSE tree, which can't be changed */
+int pt_is_read_only(pt_node_t* node);
 int pt_boolean_get(pt_node_t* boolean);
 int pt_integer_get(pt_node_t* integer);
 double pt_double_get(pt_node_t* dbl);
@@ -2,8 +2,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <strings.h>
+#include <time.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <curl/curl.h>
-#include <curl/types.h>
 #include <curl/easy.h>
 
 #include <yajl/yajl_gen.h>
@@ -20,18 +29,75 @@
 #  define HAVE_YAJL_V2 1
 #endif
 
-/* Structs */
-struct memory_chunk {
-  char *memory;
-  char *offset;
-  size_t size;
-};
-
 /* Prototypes */
-static pt_response_t* http_operation(const char* method,const char* server_target, const char* data, unsigned data_len);
-static void *myrealloc(void *ptr, size_t size);
+static pt_response_t* http_operation(pt_session_impl_t* session, const char* method,const char* server_target, const char* data, unsigned data_len, int parse);
+static pt_response_t* http_perform(pt_session_impl_t* session, const char* method,const char* server_target, const char* data, unsigned data_len, int parse);
+static pt_response_t* coalesced_get(pt_session_impl_t* session, const char* server_target);
+static pt_response_t* response_clone(pt_response_t* res);
+static pt_request_t* request_new(pt_session_impl_t* session, const char* http_method, const char* server_target, const char* data, unsigned data_len, int parse);
+static pt_response_t* request_finish(pt_request_t* req, CURLcode ret);
+static void request_free(pt_request_t* req);
+static void request_set_timeout(pt_request_t* req);
+static long request_retry_delay(pt_request_t* req, CURLcode ret);
+static void request_rewind(pt_request_t* req);
+static void request_no_replay(pt_request_t* req);
+static CURLcode request_perform_hedged(pt_request_t* req);
+static pt_request_t* request_hedge(pt_request_t* req);
+static void request_settle_hedge(pt_request_t* req, pt_request_t* winner);
+static void session_record_get(pt_session_impl_t* session, double seconds);
+static long session_hedge_delay_ms(pt_session_impl_t* session);
+static void request_use_cache(pt_request_t* req, const char* url);
+static void request_cache_result(pt_request_t* req, pt_response_t* res);
+static pt_cache_entry_t* cache_lookup(pt_session_impl_t* session, const char* url);
+static void cache_store(pt_session_impl_t* session, const char* url, const char* etag, pt_node_t* root);
+static void cache_remove(pt_session_impl_t* session, const char* url);
+static void cache_trim(pt_session_impl_t* session, size_t budget);
+static void cache_unlink(pt_session_impl_t* session, pt_cache_entry_t* entry);
+static void cache_release(pt_session_impl_t* session, pt_cache_entry_t* entry);
+static void cache_entry_free(pt_cache_entry_t* entry);
+static size_t node_bytes(pt_node_t* node);
+static pt_async_t* async_start(pt_session_impl_t* session, pt_request_t* req, pt_async_callback callback, void* userdata);
+static void async_dispatch(pt_session_impl_t* session);
+static void async_complete(pt_session_impl_t* session);
+static long async_timers(pt_session_impl_t* session, long timeout_ms);
+static pt_pooled_handle_t* acquire_handle(pt_session_impl_t* session, const char* server_target);
+static void release_handle(pt_session_impl_t* session, pt_pooled_handle_t* handle);
+static void free_pooled_handle(pt_pooled_handle_t* handle);
+static size_t host_key_len(const char* server_target);
+static char* build_url(const char* base, const char* path);
+static yajl_gen new_generator(int beautify);
+static long long monotonic_ms();
+static double monotonic_seconds();
+static void request_timing(pt_request_t* req, pt_timing_t* timing);
+static void sleep_ms(long ms);
+static char* url_escape(const char* str);
+static int changes_heartbeat_ms(const pt_changes_opts_t* opts);
+static char* changes_url(const char* database_target, const pt_changes_opts_t* opts, const char* since);
+static int changes_dispatch(pt_changes_ctx_t* changes, pt_node_t* change);
+static int changes_row(pt_node_t* row, void* data);
+static size_t changes_recv_callback(void *ptr, size_t size, size_t nmemb, void *data);
+static pt_request_t* view_request_new(pt_session_impl_t* session, const char* view_target, pt_row_callback callback, void* userdata);
+static int view_queue_row(pt_node_t* row, void* data);
+static void bulk_writer_begin(pt_bulk_writer_impl_t* writer);
+static int recv_chunk_reserve(pt_request_t* req, size_t needed, int exact);
+static void share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr);
+static void share_unlock(CURL* handle, curl_lock_data data, void* userptr);
+static pt_buffer_pool_t* buffer_pool_new();
+static int buffer_pool_take(pt_buffer_pool_t* pool, struct memory_chunk* mem);
+static void buffer_pool_retain(pt_buffer_pool_t* pool);
+static void buffer_pool_resize(pt_buffer_pool_t* pool, unsigned int max_buffers);
+static void buffer_pool_put(pt_buffer_pool_t* pool, char* memory, size_t capacity);
+static void buffer_pool_release(pt_buffer_pool_t* pool);
 static size_t recv_memory_callback(void *ptr, size_t size, size_t nmemb, void *data);
+static size_t recv_header_callback(void *ptr, size_t size, size_t nmemb, void *data);
+static size_t recv_fd_callback(void *ptr, size_t size, size_t nmemb, void *data);
+static size_t send_fd_callback(void *ptr, size_t size, size_t nmemb, void *data);
+static int send_fd_seek(void *data, curl_off_t offset, int origin);
 static size_t send_memory_callback(void *ptr, size_t size, size_t nmemb, void *data);
+static int send_memory_seek(void *data, curl_off_t offset, int origin);
+static int send_gzip_seek(void *data, curl_off_t offset, int origin);
+static size_t send_gzip_callback(void *ptr, size_t size, size_t nmemb, void *data);
+static int request_gzip_body(pt_request_t* req, const char* data, unsigned data_len);
 static int json_null(void* ctx);
 static int json_boolean(void* ctx,int boolean);
 #ifdef HAVE_YAJL_V2
@@ -52,8 +118,45 @@ static void generate_map_json(pt_map_t* map, yajl_gen g);
 static void generate_array_json(pt_array_t* map , yajl_gen g);
 static void generate_node_json(pt_node_t* node, yajl_gen g);
 static void free_map_node(pt_map_t* map);
-static void add_node_to_context_container(pt_parser_ctx_t* context, pt_node_t* value);
-static pt_node_t* parse_json(const char* json, int json_len);
+static int add_node_to_context_container(pt_parser_ctx_t* context, pt_node_t* value);
+static int emit_stream_row(pt_parser_ctx_t* context, pt_node_t* row);
+static pt_node_t* parse_json(const char* json, int json_len, pt_arena_t* arena, int in_situ, int intern_keys);
+static pt_stream_parser_t* stream_parser_new();
+static int stream_parser_feed(pt_stream_parser_t* parser, const char* json, size_t json_len);
+static pt_node_t* stream_parser_finish(pt_stream_parser_t* parser);
+static void stream_parser_rows(pt_stream_parser_t* parser, const char* key, pt_row_callback callback, void* userdata);
+static void* node_alloc(pt_parser_ctx_t* context, size_t size);
+static char* string_alloc(pt_parser_ctx_t* context, pt_node_t* node, const unsigned char* str, size_t length);
+static void push_container(pt_parser_ctx_t* context, pt_node_t* container);
+static pt_node_t* pop_container(pt_parser_ctx_t* context);
+static void* slab_alloc(size_t size);
+static void slab_free(void* ptr);
+#ifndef PT_NO_SLABS
+static pt_slab_cache_t* slab_local_cache();
+static void slab_make_key();
+static void slab_thread_exit(void* cache);
+#endif
+static pt_arena_t* arena_new();
+static void* arena_alloc(pt_arena_t* arena, size_t size);
+static void arena_free(pt_arena_t* arena);
+static int arena_read_only(pt_node_t* node, const char* caller);
+static unsigned int key_hash(const char* key, size_t len);
+static pt_interned_key_t* key_intern(const char* key, size_t len, unsigned int hashv, unsigned int limit);
+static pt_interned_key_t* interned_key_new(const char* key, size_t len, unsigned int hashv);
+static pt_interned_key_t* intern_find(const char* key, size_t len, unsigned int hashv, unsigned int* slot);
+static pt_node_t* clone_node(pt_node_t* root);
+static int map_update(pt_node_t* root, pt_node_t* additions, int append);
+static unsigned long long monotonic_us();
+static void log_write(pt_log_level_t level, const char* format, ...);
+static unsigned long long metrics_start();
+static void metrics_stop(pt_metric_t metric, unsigned long long start);
+static void metrics_record(pt_metric_t metric, unsigned long long us);
+static void metrics_count(pt_counter_t counter, unsigned long long n);
+static pt_metrics_shard_t* metrics_local_shard();
+static void metrics_make_key();
+static void metrics_thread_exit(void* shard);
+static unsigned int histogram_bucket(unsigned long long us);
+static unsigned long long histogram_bucket_value(unsigned int bucket);
 
 /* Globals */
 static yajl_callbacks callbacks = {
@@ -70,6 +173,74 @@ static yajl_callbacks callbacks = {
   json_end_array, // end array
 };
 
+static int log_level = PT_LOG_OFF;
+static pt_log_callback log_sink = NULL;
+static void* log_userdata = NULL;
+
+#define PT_LOG_ENABLED(level) \
+  ((level) <= PT_LOG_MAX_LEVEL && (level) <= __atomic_load_n(&log_level,__ATOMIC_RELAXED))
+
+#define PT_LOG(level, ...) \
+  do { if (PT_LOG_ENABLED(level)) log_write(level,__VA_ARGS__); } while(0)
+
+static int metrics_enabled = 0;
+static pt_metrics_shard_t* metrics_shards = NULL;
+static __thread pt_metrics_shard_t* metrics_shard = NULL;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t metrics_key;
+
+static __thread unsigned int retry_seed = 0;
+
+#ifndef PT_NO_SLABS
+static pt_slab_cache_t* slab_caches = NULL;
+static __thread pt_slab_cache_t* slab_cache = NULL;
+static pthread_once_t slab_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+#endif
+
+static pt_interned_key_t* intern_slots[PT_INTERN_SLOTS];
+static unsigned int intern_count = 0;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Set while a key goes into a map being parsed into an arena, so the map's
+ * hash table goes there too.  Arena maps are never changed afterwards.
+ */
+static __thread pt_arena_t* hash_arena = NULL;
+
+#undef uthash_bkt_malloc
+#undef uthash_bkt_free
+#undef uthash_tbl_malloc
+#undef uthash_tbl_free
+#define uthash_bkt_malloc(sz) (hash_arena ? arena_alloc(hash_arena,sz) : malloc(sz))
+#define uthash_bkt_free(ptr) do { if (!hash_arena) free(ptr); } while(0)
+#define uthash_tbl_malloc(sz) (hash_arena ? arena_alloc(hash_arena,sz) : malloc(sz))
+#define uthash_tbl_free(ptr) do { if (!hash_arena) free(ptr); } while(0)
+
+/* HASH_ADD_KEYPTR for a key whose hash is already known, like an interned one */
+#define HASH_ADD_KEYPTR_BYHASHVALUE(hh,head,keyptr,keylen_in,hashval,add)      \
+do {                                                                           \
+ unsigned _ha_bkt;                                                             \
+ (add)->hh.next = NULL;                                                        \
+ (add)->hh.key = (char*)keyptr;                                                \
+ (add)->hh.keylen = keylen_in;                                                 \
+ if (!(head)) {                                                                \
+    head = (add);                                                              \
+    (head)->hh.prev = NULL;                                                    \
+    HASH_MAKE_TABLE(hh,head);                                                  \
+ } else {                                                                      \
+    (head)->hh.tbl->tail->next = (add);                                        \
+    (add)->hh.prev = ELMT_FROM_HH((head)->hh.tbl, (head)->hh.tbl->tail);       \
+    (head)->hh.tbl->tail = &((add)->hh);                                       \
+ }                                                                             \
+ (head)->hh.tbl->num_items++;                                                  \
+ (add)->hh.tbl = (head)->hh.tbl;                                               \
+ (add)->hh.hashv = (hashval);                                                  \
+ HASH_TO_BKT((add)->hh.hashv,(head)->hh.tbl->num_buckets,_ha_bkt);             \
+ HASH_ADD_TO_BKT((head)->hh.tbl->buckets[_ha_bkt],&(add)->hh);                 \
+ HASH_FSCK(hh,head);                                                           \
+} while(0)
+
 
 /* Public Implementation */
 
@@ -84,70 +255,760 @@ void pt_cleanup()
   curl_global_cleanup();
 }
 
+void pt_set_log(pt_log_level_t level, pt_log_callback sink, void* userdata)
+{
+  log_sink = sink;
+  log_userdata = userdata;
+  __atomic_store_n(&log_level,level,__ATOMIC_RELEASE);
+}
+
 void pt_free_response(pt_response_t* response)
 {
   if (response) {
     if (response->root) {
       pt_free_node(response->root);
     }
-    free(response->raw_json);
+    pt_response_impl_t* impl = (pt_response_impl_t*) response;
+    if (impl->arena)
+      arena_free(impl->arena);
+    char* body = impl->body ? impl->body : response->raw_json;
+    if (impl->pool) {
+      buffer_pool_put(impl->pool,body,impl->raw_json_capacity);
+      buffer_pool_release(impl->pool);
+    } else {
+      free(body);
+    }
     free(response);
   }
 }
 
 void free_parser_ctx(pt_parser_ctx_t* parser_ctx)
 {
+  // a row we stopped in the middle of isn't attached to the tree
+  pt_free_node(parser_ctx->stream_row);
   while(parser_ctx->stack) {
     pt_container_ctx_t* old_head = parser_ctx->stack;
     LL_DELETE(parser_ctx->stack,old_head);
     free(old_head);
   }
+  while(parser_ctx->spare) {
+    pt_container_ctx_t* old_head = parser_ctx->spare;
+    LL_DELETE(parser_ctx->spare,old_head);
+    free(old_head);
+  }
   free(parser_ctx);
 }
 
 pt_response_t* pt_delete(const char* server_target)
 {
-  pt_response_t* res = http_operation("DELETE",server_target,NULL,0);
-  res->root = parse_json(res->raw_json,res->raw_json_len);
-  return res;
+  return pt_session_delete(NULL,server_target);
 }
 
 pt_response_t* pt_put(const char* server_target, pt_node_t* doc)
+{
+  return pt_session_put(NULL,server_target,doc);
+}
+
+pt_response_t* pt_put_raw(const char* server_target, const char* data, unsigned int data_len)
+{
+  return pt_session_put_raw(NULL,server_target,data,data_len);
+}
+
+pt_response_t* pt_post_raw(const char* server_target, const char* data, unsigned int data_len)
+{
+  return pt_session_post_raw(NULL,server_target,data,data_len);
+}
+
+pt_response_t* pt_unparsed_get(const char* server_target)
+{
+  return pt_session_unparsed_get(NULL,server_target);
+}
+
+pt_response_t* pt_get(const char* server_target)
+{
+  return pt_session_get(NULL,server_target);
+}
+
+pt_session_t* pt_session_new(unsigned int max_pool_size)
+{
+  pt_session_impl_t* session = (pt_session_impl_t*) calloc(1,sizeof(pt_session_impl_t));
+  int i;
+  session->max_pool_size = max_pool_size;
+  session->retain_raw_json = 1;
+  session->max_connections = PT_DEFAULT_MAX_CONNECTIONS;
+  session->connect_timeout_ms = PT_DEFAULT_CONNECT_TIMEOUT_MS;
+  session->retry_backoff_ms = PT_DEFAULT_RETRY_BACKOFF_MS;
+  pthread_mutex_init(&session->lock,NULL);
+
+  for(i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&session->share_locks[i],NULL);
+  session->share = curl_share_init();
+  curl_share_setopt(session->share,CURLSHOPT_LOCKFUNC,share_lock);
+  curl_share_setopt(session->share,CURLSHOPT_UNLOCKFUNC,share_unlock);
+  curl_share_setopt(session->share,CURLSHOPT_USERDATA,session);
+  curl_share_setopt(session->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
+  curl_share_setopt(session->share,CURLSHOPT_SHARE,CURL_LOCK_DATA_SSL_SESSION);
+  // curl can't share a connection cache between threads, acquire_handle's
+  // thread affinity is what keeps each thread on its own warm connection
+  return (pt_session_t*) session;
+}
+
+void pt_session_free(pt_session_t* session)
+{
+  if (session) {
+    pt_session_impl_t* real_session = (pt_session_impl_t*) session;
+    while(real_session->pending)
+      pt_async_cancel(session,(pt_async_t*) real_session->pending);
+    while(real_session->running)
+      pt_async_cancel(session,(pt_async_t*) real_session->running);
+    if (real_session->multi)
+      curl_multi_cleanup(real_session->multi);
+    while(real_session->idle) {
+      pt_pooled_handle_t* handle = real_session->idle;
+      DL_DELETE(real_session->idle,handle);
+      free_pooled_handle(handle);
+    }
+    cache_trim(real_session,0);
+    if (real_session->buffer_pool) {
+      // responses still out there free their buffers instead of pooling them
+      buffer_pool_resize(real_session->buffer_pool,0);
+      buffer_pool_release(real_session->buffer_pool);
+    }
+    // every handle using the share is gone by now
+    curl_share_cleanup(real_session->share);
+    int i;
+    for(i = 0; i < CURL_LOCK_DATA_LAST; i++)
+      pthread_mutex_destroy(&real_session->share_locks[i]);
+    pthread_mutex_destroy(&real_session->lock);
+    free(real_session->unix_socket);
+    free(real_session);
+  }
+}
+
+pt_response_t* pt_session_delete(pt_session_t* session, const char* server_target)
+{
+  pt_response_t* res = http_operation((pt_session_impl_t*) session,"DELETE",server_target,NULL,0,1);
+  return res;
+}
+
+pt_response_t* pt_session_put(pt_session_t* session, const char* server_target, pt_node_t* doc)
 {
   char* data = NULL;
   int data_len = 0;
+  double start = monotonic_seconds();
   if (doc) {
     data = pt_to_json(doc,0);
     if (data)
       data_len = strlen(data);
   }
-  pt_response_t* res = http_operation("PUT",server_target,data,data_len);
-  res->root = parse_json(res->raw_json,res->raw_json_len);
+  double serialize = monotonic_seconds() - start;
+  pt_response_t* res = http_operation((pt_session_impl_t*) session,"PUT",server_target,data,data_len,1);
+  res->timing.serialize = serialize;
   if (data)
     free(data);
   return res;
 }
 
-pt_response_t* pt_put_raw(const char* server_target, const char* data, unsigned int data_len)
+pt_response_t* pt_session_put_raw(pt_session_t* session, const char* server_target, const char* data, unsigned int data_len)
 {
-  pt_response_t* res = http_operation("PUT",server_target,data,data_len);
-  res->root = parse_json(res->raw_json,res->raw_json_len);
+  pt_response_t* res = http_operation((pt_session_impl_t*) session,"PUT",server_target,data,data_len,1);
   return res;
 }
 
-pt_response_t* pt_unparsed_get(const char* server_target)
+pt_response_t* pt_session_post_raw(pt_session_t* session, const char* server_target, const char* data, unsigned int data_len)
 {
-  pt_response_t* res = http_operation("GET",server_target,NULL,0);
+  pt_response_t* res = http_operation((pt_session_impl_t*) session,"POST",server_target,data,data_len,1);
   return res;
 }
 
-pt_response_t* pt_get(const char* server_target)
+pt_response_t* pt_session_unparsed_get(pt_session_t* session, const char* server_target)
+{
+  pt_response_t* res = http_operation((pt_session_impl_t*) session,"GET",server_target,NULL,0,0);
+  return res;
+}
+
+pt_response_t* pt_session_get(pt_session_t* session, const char* server_target)
+{
+  pt_response_t* res = http_operation((pt_session_impl_t*) session,"GET",server_target,NULL,0,1);
+  return res;
+}
+
+pt_bulk_get_result_t* pt_bulk_get(pt_session_t* session, const char* database_target, const char** ids, unsigned int n)
+{
+  unsigned int i;
+  pt_node_t* body = pt_map_new();
+  pt_node_t* keys = pt_array_new();
+  for(i = 0; i < n; i++)
+    pt_array_push_back(keys,pt_string_new(ids[i]));
+  pt_map_set(body,"keys",keys);
+  double start = monotonic_seconds();
+  char* data = pt_to_json(body,0);
+  double serialize = monotonic_seconds() - start;
+  pt_free_node(body);
+
+  char* url = build_url(database_target,"_all_docs?include_docs=true");
+  pt_response_t* res = http_operation((pt_session_impl_t*) session,"POST",url,data,strlen(data),1);
+  res->timing.serialize = serialize;
+  free(url);
+  free(data);
+
+  pt_bulk_get_result_t* result = (pt_bulk_get_result_t*) calloc(1,sizeof(pt_bulk_get_result_t));
+  result->response = res;
+  result->response_code = res->response_code;
+  result->len = n;
+  result->docs = (pt_bulk_doc_t*) calloc(n ? n : 1,sizeof(pt_bulk_doc_t));
+
+  /* rows come back in the same order as the keys we asked for */
+  pt_iterator_t* rows = pt_iterator(pt_map_get(res->root,"rows"));
+  const char* request_error = pt_string_get(pt_map_get(res->root,"error"));
+  for(i = 0; i < n; i++) {
+    pt_bulk_doc_t* doc = &result->docs[i];
+    pt_node_t* row = pt_iterator_next(rows,NULL);
+    doc->id = ids[i];
+    if (!row) {
+      doc->error = request_error ? request_error : "request_failed";
+      continue;
+    }
+    doc->error = pt_string_get(pt_map_get(row,"error"));
+    if (doc->error)
+      continue;
+    doc->doc = pt_map_get(row,"doc");
+    // a null doc, no doc at all, or something that isn't one all mean there's nothing to hand back
+    if (!doc->doc || doc->doc->type != PT_MAP) {
+      doc->doc = NULL;
+      doc->error = pt_boolean_get(pt_map_get(pt_map_get(row,"value"),"deleted")) ? "deleted" : "not_found";
+    }
+  }
+  free(rows);
+  return result;
+}
+
+void pt_free_bulk_get_result(pt_bulk_get_result_t* result)
+{
+  if (result) {
+    pt_free_response(result->response);
+    free(result->docs);
+    free(result);
+  }
+}
+
+pt_bulk_writer_t* pt_bulk_writer_new(pt_session_t* session, const char* database_target, unsigned int max_docs, unsigned int max_bytes, unsigned int max_delay_ms, pt_bulk_write_callback callback, void* userdata)
+{
+  pt_bulk_writer_impl_t* writer = (pt_bulk_writer_impl_t*) calloc(1,sizeof(pt_bulk_writer_impl_t));
+  writer->session = (pt_session_impl_t*) session;
+  writer->url = build_url(database_target,"_bulk_docs");
+  writer->max_docs = max_docs;
+  writer->max_bytes = max_bytes;
+  writer->max_delay_ms = max_delay_ms;
+  writer->callback = callback;
+  writer->userdata = userdata;
+  bulk_writer_begin(writer);
+  return (pt_bulk_writer_t*) writer;
+}
+
+int pt_bulk_writer_add(pt_bulk_writer_t* bulk_writer, pt_node_t* doc)
+{
+  pt_bulk_writer_impl_t* writer = (pt_bulk_writer_impl_t*) bulk_writer;
+  if (!writer || !doc || doc->type != PT_MAP)
+    return 1;
+
+  if (writer->count == writer->ids_capacity) {
+    writer->ids_capacity = writer->ids_capacity ? writer->ids_capacity * 2 : 16;
+    writer->ids = (char**) realloc(writer->ids,writer->ids_capacity * sizeof(char*));
+  }
+  const char* id = pt_string_get(pt_map_get(doc,"_id"));
+  writer->ids[writer->count++] = id ? strdup(id) : NULL;
+  if (writer->count == 1)
+    writer->first_add_ms = monotonic_ms();
+
+  generate_node_json(doc,writer->gen);
+
+  const unsigned char* buf = NULL;
+#ifdef HAVE_YAJL_V2
+  size_t len = 0;
+#else
+  unsigned int len = 0;
+#endif
+  yajl_gen_get_buf(writer->gen,&buf,&len);
+
+  if ((writer->max_docs && writer->count >= writer->max_docs) ||
+      (writer->max_bytes && len >= writer->max_bytes))
+    return pt_bulk_writer_flush(bulk_writer);
+  return pt_bulk_writer_poll(bulk_writer);
+}
+
+int pt_bulk_writer_poll(pt_bulk_writer_t* bulk_writer)
+{
+  pt_bulk_writer_impl_t* writer = (pt_bulk_writer_impl_t*) bulk_writer;
+  if (writer && writer->count > 0 && writer->max_delay_ms &&
+      monotonic_ms() - writer->first_add_ms >= writer->max_delay_ms)
+    return pt_bulk_writer_flush(bulk_writer);
+  return 0;
+}
+
+int pt_bulk_writer_flush(pt_bulk_writer_t* bulk_writer)
+{
+  pt_bulk_writer_impl_t* writer = (pt_bulk_writer_impl_t*) bulk_writer;
+  unsigned int i;
+  if (!writer || writer->count == 0)
+    return 0;
+
+  yajl_gen_array_close(writer->gen);
+  yajl_gen_map_close(writer->gen);
+
+  const unsigned char* buf = NULL;
+#ifdef HAVE_YAJL_V2
+  size_t len = 0;
+#else
+  unsigned int len = 0;
+#endif
+  yajl_gen_get_buf(writer->gen,&buf,&len);
+
+  pt_response_t* res = http_operation(writer->session,"POST",writer->url,(const char*) buf,len,1);
+  int failed = res->response_code < 200 || res->response_code >= 300 ||
+    !res->root || res->root->type != PT_ARRAY;
+
+  /*
+   * One result per doc, in the order they were added.  Anything but an
+   * array is an error map or nothing at all, and then every doc failed.
+   */
+  pt_iterator_t* results = failed ? NULL : pt_iterator(res->root);
+  const char* request_error = pt_string_get(pt_map_get(res->root,"error"));
+  for(i = 0; i < writer->count; i++) {
+    pt_node_t* result = results ? pt_iterator_next(results,NULL) : NULL;
+    if (writer->callback) {
+      const char* id = pt_string_get(pt_map_get(result,"id"));
+      const char* error = pt_string_get(pt_map_get(result,"error"));
+      if (!result)
+        error = request_error ? request_error : "request_failed";
+      writer->callback(id ? id : writer->ids[i],
+          error ? NULL : pt_string_get(pt_map_get(result,"rev")),
+          error,writer->userdata);
+    }
+    free(writer->ids[i]);
+  }
+  free(results);
+  pt_free_response(res);
+
+  yajl_gen_free(writer->gen);
+  writer->count = 0;
+  bulk_writer_begin(writer);
+  return failed;
+}
+
+void pt_bulk_writer_free(pt_bulk_writer_t* bulk_writer)
+{
+  pt_bulk_writer_impl_t* writer = (pt_bulk_writer_impl_t*) bulk_writer;
+  if (writer) {
+    pt_bulk_writer_flush(bulk_writer);
+    yajl_gen_free(writer->gen);
+    free(writer->ids);
+    free(writer->url);
+    free(writer);
+  }
+}
+
+int pt_changes_follow(pt_session_t* session, const char* database_target, const char* since, const pt_changes_opts_t* opts, pt_changes_callback callback, void* userdata)
+{
+  pt_changes_opts_t defaults = {0,0,0,NULL,0};
+  pt_changes_ctx_t changes;
+  int failures = 0;
+  int result = 0;
+  if (!opts)
+    opts = &defaults;
+
+  memset(&changes,0,sizeof(changes));
+  changes.opts = opts;
+  changes.callback = callback;
+  changes.userdata = userdata;
+  changes.last_seq = strdup(since ? since : "0");
+
+  while (!changes.stopped) {
+    char* attempt_seq = strdup(changes.last_seq);
+    char* url = changes_url(database_target,opts,changes.last_seq);
+    pt_request_t* req = request_new((pt_session_impl_t*) session,"GET",url,NULL,0,0);
+    CURL* curl_handle = req->handle->curl;
+    free(url);
+    // the feed reconnects on its own and is meant to outlast any deadline
+    request_no_replay(req);
+    req->deadline_ms = 0;
+    request_set_timeout(req);
+
+    changes.status = 0;
+    changes.curl = curl_handle;
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, changes_recv_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void*) &changes);
+    /* heartbeats keep a healthy feed talking, so silence means it died */
+    curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME, (long) (2 * changes_heartbeat_ms(opts) / 1000 + 1));
+
+    CURLcode ret = curl_easy_perform(curl_handle);
+    pt_response_t* res = request_finish(req,changes.stopped ? CURLE_OK : ret);
+    long code = res->response_code;
+    pt_free_response(res);
+
+    /* a longpoll envelope still holds last_seq, a broken line is dropped */
+    if (changes.parser) {
+      pt_node_t* rest = stream_parser_finish(changes.parser);
+      changes.parser = NULL;
+      if (rest && !changes.stopped && opts->longpoll && code == 200 && ret == CURLE_OK)
+        changes_dispatch(&changes,rest);
+      pt_free_node(rest);
+    }
+
+    // continuous feeds only ever end by dropping, so one that got somewhere was healthy
+    int progressed = strcmp(attempt_seq,changes.last_seq) != 0;
+    free(attempt_seq);
+    if (changes.stopped)
+      break;
+
+    int succeeded = code >= 200 && code < 300 && ret == CURLE_OK;
+    if (succeeded || progressed)
+      failures = 0;
+    if (succeeded)
+      continue;
+    // 4xx means the request itself is wrong, so trying again won't help
+    if ((code >= 400 && code < 500) || opts->max_reconnects < 0 ||
+        (opts->max_reconnects > 0 && failures >= opts->max_reconnects)) {
+      result = code;
+      break;
+    }
+    sleep_ms(failures < 5 ? 1000 << failures : 30000);
+    failures++;
+  }
+
+  if (changes.seq_overflow)
+    result = -1;
+  free(changes.last_seq);
+  return result;
+}
+
+pt_response_t* pt_view_stream(pt_session_t* session, const char* view_target, pt_view_callback callback, void* userdata)
+{
+  pt_request_t* req = view_request_new((pt_session_impl_t*) session,view_target,callback,userdata);
+  CURLcode ret = curl_easy_perform(req->handle->curl);
+  // stopping early isn't a failure
+  if (req->parser->ctx->stopped)
+    ret = CURLE_OK;
+  return request_finish(req,ret);
+}
+
+pt_view_t* pt_view_open(pt_session_t* session, const char* view_target)
+{
+  pt_view_impl_t* view = (pt_view_impl_t*) calloc(1,sizeof(pt_view_impl_t));
+  view->req = view_request_new((pt_session_impl_t*) session,view_target,view_queue_row,view);
+  view->multi = curl_multi_init();
+  curl_multi_add_handle(view->multi,view->req->handle->curl);
+  return (pt_view_t*) view;
+}
+
+pt_node_t* pt_view_next(pt_view_t* pt_view)
+{
+  pt_view_impl_t* view = (pt_view_impl_t*) pt_view;
+  if (!view)
+    return NULL;
+
+  pt_free_node(view->current);
+  view->current = NULL;
+
+  /* pull more of the body through the parser until a row falls out */
+  while (!view->rows && !view->done) {
+    int running = 0;
+    CURLMsg* msg;
+    int msgs_left;
+    curl_multi_perform(view->multi,&running);
+    while ((msg = curl_multi_info_read(view->multi,&msgs_left))) {
+      if (msg->msg == CURLMSG_DONE) {
+        view->done = 1;
+        view->result = msg->data.result;
+      }
+    }
+    if (!view->rows && !view->done)
+      curl_multi_wait(view->multi,NULL,0,1000,NULL);
+  }
+
+  if (view->rows) {
+    pt_view_row_t* head = view->rows;
+    DL_DELETE(view->rows,head);
+    view->current = head->row;
+    free(head);
+  }
+  return view->current;
+}
+
+pt_response_t* pt_view_close(pt_view_t* pt_view)
 {
-  pt_response_t* res = http_operation("GET",server_target,NULL,0);
-  res->root = parse_json(res->raw_json,res->raw_json_len);
+  pt_view_impl_t* view = (pt_view_impl_t*) pt_view;
+  if (!view)
+    return NULL;
+
+  curl_multi_remove_handle(view->multi,view->req->handle->curl);
+  curl_multi_cleanup(view->multi);
+  // closing before the end leaves the rest of the body unread on the connection
+  if (!view->done)
+    view->req->cut_short = 1;
+  pt_response_t* res = request_finish(view->req,view->done ? view->result : CURLE_ABORTED_BY_CALLBACK);
+
+  pt_free_node(view->current);
+  while (view->rows) {
+    pt_view_row_t* head = view->rows;
+    DL_DELETE(view->rows,head);
+    pt_free_node(head->row);
+    free(head);
+  }
+  free(view);
   return res;
 }
 
+pt_response_t* pt_attachment_get_to_fd(pt_session_t* session, const char* attachment_target, int fd)
+{
+  pt_request_t* req = request_new((pt_session_impl_t*) session,"GET",attachment_target,NULL,0,1);
+  // whatever went into fd is there for good
+  request_no_replay(req);
+  req->fd = fd;
+  curl_easy_setopt(req->handle->curl, CURLOPT_WRITEFUNCTION, recv_fd_callback);
+  return request_finish(req,curl_easy_perform(req->handle->curl));
+}
+
+pt_response_t* pt_attachment_put_from_fd(pt_session_t* session, const char* attachment_target, int fd,
+    const char* content_type, int use_mmap)
+{
+  pt_request_t* req = request_new((pt_session_impl_t*) session,"PUT",attachment_target,NULL,0,1);
+  CURL* curl_handle = req->handle->curl;
+  struct stat st;
+  curl_off_t length = -1;
+  off_t position = lseek(fd,0,SEEK_CUR);
+  if (!fstat(fd,&st) && S_ISREG(st.st_mode) && position >= 0 && st.st_size >= position)
+    length = st.st_size - position;
+
+  if (use_mmap && length > 0) {
+    req->mapped = mmap(NULL,(size_t) st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if (req->mapped == MAP_FAILED) {
+      req->mapped = NULL;
+    } else {
+      req->mapped_len = (size_t) st.st_size;
+      madvise(req->mapped,req->mapped_len,MADV_SEQUENTIAL);
+      req->send_chunk.offset = (char*) req->mapped + position;
+      req->send_chunk.size = (size_t) length;
+      req->send_start = req->send_chunk.offset;
+      req->send_len = req->send_chunk.size;
+    }
+  }
+  if (!req->mapped) {
+    req->fd = fd;
+    req->fd_start = position;
+    curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, send_fd_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_READDATA, (void*) req);
+    curl_easy_setopt(curl_handle, CURLOPT_SEEKFUNCTION, send_fd_seek);
+  }
+  // -1 sends it chunked
+  curl_easy_setopt(curl_handle, CURLOPT_INFILESIZE_LARGE, length);
+
+  if (content_type) {
+    char* header = (char*) malloc(strlen(content_type) + sizeof("Content-Type: "));
+    sprintf(header,"Content-Type: %s",content_type);
+    req->headers = curl_slist_append(req->headers,header);
+    free(header);
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, req->headers);
+  }
+  return request_finish(req,curl_easy_perform(curl_handle));
+}
+
+int pt_session_setopt(pt_session_t* session, pt_session_option_t option, long value)
+{
+  pt_session_impl_t* real_session = (pt_session_impl_t*) session;
+  if (!session)
+    return 1;
+  switch(option) {
+    case PT_OPT_MAX_INFLIGHT:
+      real_session->max_inflight = value > 0 ? value : 0;
+      if (real_session->multi)
+        async_dispatch(real_session);
+      return 0;
+    case PT_OPT_STREAM_PARSE:
+      real_session->stream_parse = value != 0;
+      return 0;
+    case PT_OPT_RETAIN_RAW_JSON:
+      real_session->retain_raw_json = value != 0;
+      return 0;
+    case PT_OPT_ACCEPT_ENCODING:
+      real_session->accept_encoding = value != 0;
+      return 0;
+    case PT_OPT_GZIP_MIN_SIZE:
+      real_session->gzip_min_size = value > 0 ? value : 0;
+      return 0;
+    case PT_OPT_MAX_CONNECTIONS:
+      real_session->max_connections = value > 0 ? value : PT_DEFAULT_MAX_CONNECTIONS;
+      return 0;
+    case PT_OPT_HTTP_VERSION:
+      if (value < PT_HTTP_DEFAULT || value > PT_HTTP_2_PRIOR_KNOWLEDGE)
+        return 1;
+      real_session->http_version = (pt_http_version_t) value;
+      return 0;
+    case PT_OPT_TIMEOUT_MS:
+      real_session->timeout_ms = value > 0 ? value : 0;
+      return 0;
+    case PT_OPT_CONNECT_TIMEOUT_MS:
+      real_session->connect_timeout_ms = value > 0 ? value : PT_DEFAULT_CONNECT_TIMEOUT_MS;
+      return 0;
+    case PT_OPT_RETRIES:
+      real_session->retries = value > 0 ? value : 0;
+      return 0;
+    case PT_OPT_RETRY_BACKOFF_MS:
+      real_session->retry_backoff_ms = value > 0 ? value : 0;
+      return 0;
+    case PT_OPT_HEDGE_PERCENTILE:
+      if (value < 0 || value >= 100)
+        return 1;
+      real_session->hedge_percentile = value;
+      return 0;
+    case PT_OPT_COALESCE_GETS:
+      real_session->coalesce_gets = value != 0;
+      return 0;
+    case PT_OPT_ARENA_PARSE:
+      real_session->arena_parse = value != 0;
+      return 0;
+    case PT_OPT_IN_SITU_STRINGS:
+      real_session->in_situ_strings = value != 0;
+      return 0;
+    case PT_OPT_INTERN_KEYS:
+      real_session->intern_keys = value != 0;
+      return 0;
+    case PT_OPT_CACHE_BYTES:
+      real_session->cache_budget = value > 0 ? value : 0;
+      cache_trim(real_session,real_session->cache_budget);
+      return 0;
+    case PT_OPT_BUFFER_POOL: {
+      pt_buffer_pool_t* dropped = NULL;
+      // requests made on other threads pick the pool up under the lock
+      pthread_mutex_lock(&real_session->lock);
+      if (value > 0) {
+        if (!real_session->buffer_pool)
+          real_session->buffer_pool = buffer_pool_new();
+        buffer_pool_resize(real_session->buffer_pool,value);
+      } else if (real_session->buffer_pool) {
+        dropped = real_session->buffer_pool;
+        real_session->buffer_pool = NULL;
+      }
+      pthread_mutex_unlock(&real_session->lock);
+      // requests still out hold their own reference, their buffers just get freed
+      if (dropped) {
+        buffer_pool_resize(dropped,0);
+        buffer_pool_release(dropped);
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int pt_session_set_unix_socket(pt_session_t* session, const char* path)
+{
+  pt_session_impl_t* real_session = (pt_session_impl_t*) session;
+  char* old;
+  if (!session)
+    return 1;
+  // requests on other threads may be reading the old path
+  pthread_mutex_lock(&real_session->lock);
+  old = real_session->unix_socket;
+  real_session->unix_socket = path ? strdup(path) : NULL;
+  pthread_mutex_unlock(&real_session->lock);
+  free(old);
+  return 0;
+}
+
+pt_async_t* pt_async_get(pt_session_t* session, const char* server_target, pt_async_callback callback, void* userdata)
+{
+  if (!session)
+    return NULL;
+  pt_request_t* req = request_new((pt_session_impl_t*) session,"GET",server_target,NULL,0,1);
+  request_use_cache(req,server_target);
+  return async_start((pt_session_impl_t*) session,req,callback,userdata);
+}
+
+pt_async_t* pt_async_put(pt_session_t* session, const char* server_target, pt_node_t* doc, pt_async_callback callback, void* userdata)
+{
+  char* data = NULL;
+  int data_len = 0;
+  if (!session)
+    return NULL;
+  double start = monotonic_seconds();
+  if (doc) {
+    data = pt_to_json(doc,0);
+    if (data)
+      data_len = strlen(data);
+  }
+  pt_request_t* req = request_new((pt_session_impl_t*) session,"PUT",server_target,data,data_len,1);
+  req->serialize_time = monotonic_seconds() - start;
+  // the body has to outlive this call, so the request keeps the json
+  req->send_chunk.memory = data;
+  return async_start((pt_session_impl_t*) session,req,callback,userdata);
+}
+
+pt_async_t* pt_async_delete(pt_session_t* session, const char* server_target, pt_async_callback callback, void* userdata)
+{
+  if (!session)
+    return NULL;
+  pt_request_t* req = request_new((pt_session_impl_t*) session,"DELETE",server_target,NULL,0,1);
+  return async_start((pt_session_impl_t*) session,req,callback,userdata);
+}
+
+void pt_async_cancel(pt_session_t* session, pt_async_t* async)
+{
+  if (session && async) {
+    pt_session_impl_t* real_session = (pt_session_impl_t*) session;
+    pt_request_t* req = (pt_request_t*) async;
+    if (req->twin) {
+      pt_request_t* twin = req->twin;
+      req->twin = NULL;
+      twin->twin = NULL;
+      pt_async_cancel(session,(pt_async_t*) twin);
+    }
+    if (req->in_multi) {
+      curl_multi_remove_handle(real_session->multi,req->handle->curl);
+      DL_DELETE(real_session->running,req);
+      real_session->inflight--;
+    } else if (!req->parked) {
+      DL_DELETE(real_session->pending,req);
+      real_session->pending_count--;
+    }
+    // a half finished transfer leaves the connection in an unknown state
+    free_pooled_handle(req->handle);
+    request_free(req);
+    async_dispatch(real_session);
+  }
+}
+
+int pt_session_perform(pt_session_t* session, int timeout_ms)
+{
+  pt_session_impl_t* real_session = (pt_session_impl_t*) session;
+  int running = 0;
+  if (!session || !real_session->multi)
+    return 0;
+
+  async_timers(real_session,0);
+  curl_multi_perform(real_session->multi,&running);
+  async_complete(real_session);
+  if (real_session->inflight + real_session->pending_count > 0 && timeout_ms > 0) {
+    long wait_ms = async_timers(real_session,timeout_ms);
+    // only retries waiting out their backoff are left
+    if (real_session->inflight > 0)
+      curl_multi_wait(real_session->multi,NULL,0,wait_ms,NULL);
+    else
+      sleep_ms(wait_ms);
+    async_timers(real_session,0);
+    curl_multi_perform(real_session->multi,&running);
+    async_complete(real_session);
+  }
+  return real_session->inflight + real_session->pending_count;
+}
+
+void pt_session_wait(pt_session_t* session)
+{
+  while(pt_session_perform(session,1000) > 0)
+    ;
+}
+
 pt_node_t* pt_map_get(pt_node_t* map,const char* key)
 {
   if (map && map->type == PT_MAP && key) {
@@ -164,6 +1025,38 @@ pt_node_t* pt_map_get(pt_node_t* map,const char* key)
   }
 }
 
+pt_key_t* pt_key_intern(const char* key)
+{
+  if (!key)
+    return NULL;
+  size_t len = strlen(key);
+  unsigned int hashv = key_hash(key,len);
+  // NULL if it's too long or the table is full, a handle nobody frees would leak
+  return (pt_key_t*) key_intern(key,len,hashv,PT_INTERN_MAX_KEYS);
+}
+
+/*
+ * Go straight to the bucket the key's hash picks.  Keys of maps parsed with
+ * PT_OPT_INTERN_KEYS are the interned string itself, anything else has to
+ * match byte for byte.
+ */
+pt_node_t* pt_map_get_k(pt_node_t* map, const pt_key_t* key)
+{
+  const pt_interned_key_t* interned = (const pt_interned_key_t*) key;
+  if (map && map->type == PT_MAP && interned && ((pt_map_t*) map)->key_values) {
+    UT_hash_table* tbl = ((pt_map_t*) map)->key_values->hh.tbl;
+    UT_hash_handle* hh;
+    unsigned bkt;
+    HASH_TO_BKT(interned->hashv,tbl->num_buckets,bkt);
+    for(hh = tbl->buckets[bkt].hh_head; hh; hh = hh->hh_next) {
+      if (hh->key == interned->str ||
+          (hh->hashv == interned->hashv && hh->keylen == interned->len && !memcmp(hh->key,interned->str,interned->len)))
+        return ((pt_key_value_t*) ELMT_FROM_HH(tbl,hh))->value;
+    }
+  }
+  return NULL;
+}
+
 unsigned int pt_array_len(pt_node_t* array)
 {
   if (array && array->type == PT_ARRAY) {
@@ -192,7 +1085,7 @@ pt_node_t* pt_array_get(pt_node_t* array, unsigned int idx)
 /* Pass in the pointer to the elem and remove it if it exists */
 void pt_array_remove(pt_node_t* array, pt_node_t* node)
 {
-  if (array && array->type == PT_ARRAY) {
+  if (array && array->type == PT_ARRAY && !arena_read_only(array,"pt_array_remove")) {
     pt_array_t* real_array = (pt_array_t*) array;
     pt_array_elem_t* cur = NULL;
     pt_array_elem_t* tmp = NULL;
@@ -200,7 +1093,7 @@ void pt_array_remove(pt_node_t* array, pt_node_t* node)
       if (cur->node == node) {
         TAILQ_REMOVE(&real_array->head,cur,entries);
         pt_free_node(cur->node);
-        free(cur);
+        slab_free(cur);
         real_array->len--;
         break;
       }
@@ -210,9 +1103,9 @@ void pt_array_remove(pt_node_t* array, pt_node_t* node)
 
 void pt_array_push_front(pt_node_t* array, pt_node_t* node)
 {
-  if (array && array->type == PT_ARRAY) {
+  if (array && array->type == PT_ARRAY && !arena_read_only(array,"pt_array_push_front")) {
     pt_array_t* real_array = (pt_array_t*) array;
-    pt_array_elem_t* elem = (pt_array_elem_t*) malloc(sizeof(pt_array_elem_t));
+    pt_array_elem_t* elem = (pt_array_elem_t*) slab_alloc(sizeof(pt_array_elem_t));
     elem->node = node;
     real_array->len++;
     TAILQ_INSERT_HEAD(&real_array->head,elem,entries);
@@ -221,9 +1114,9 @@ void pt_array_push_front(pt_node_t* array, pt_node_t* node)
 
 void pt_array_push_back(pt_node_t* array, pt_node_t* node)
 {
-  if (array && array->type == PT_ARRAY) {
+  if (array && array->type == PT_ARRAY && !arena_read_only(array,"pt_array_push_back")) {
     pt_array_t* real_array = (pt_array_t*) array;
-    pt_array_elem_t* elem = (pt_array_elem_t*) malloc(sizeof(pt_array_elem_t));
+    pt_array_elem_t* elem = (pt_array_elem_t*) slab_alloc(sizeof(pt_array_elem_t));
     elem->node = node;
     real_array->len++;
     TAILQ_INSERT_TAIL(&real_array->head,elem,entries);
@@ -280,6 +1173,11 @@ int pt_is_null(pt_node_t* null)
     return !null || null->type == PT_NULL;
 }
 
+int pt_is_read_only(pt_node_t* node)
+{
+  return node && PT_IN_ARENA(node);
+}
+
 int pt_boolean_get(pt_node_t* boolean)
 {
   if (boolean && boolean->type == PT_BOOLEAN) {
@@ -324,21 +1222,21 @@ const char* pt_string_get(pt_node_t* string)
 /* Build a new pt_map_t* and initialize it */
 pt_node_t* pt_map_new()
 {
-  pt_node_t* new_node = (pt_node_t*) calloc(1,sizeof(pt_map_t));
+  pt_node_t* new_node = (pt_node_t*) slab_alloc(sizeof(pt_map_t));
   new_node->type = PT_MAP;
   return new_node;
 }
 
 pt_node_t* pt_null_new()
 {
-  pt_node_t* new_node = (pt_node_t*) calloc(1,sizeof(pt_null_value_t));
+  pt_node_t* new_node = (pt_node_t*) slab_alloc(sizeof(pt_null_value_t));
   new_node->type = PT_NULL;
   return new_node;
 }
 
 pt_node_t* pt_bool_new(int boolean)
 {
-  pt_bool_value_t* new_node = (pt_bool_value_t*) calloc(1,sizeof(pt_bool_value_t));
+  pt_bool_value_t* new_node = (pt_bool_value_t*) slab_alloc(sizeof(pt_bool_value_t));
   new_node->parent.type = PT_BOOLEAN;
   new_node->value = boolean;
   return (pt_node_t*) new_node;
@@ -346,7 +1244,7 @@ pt_node_t* pt_bool_new(int boolean)
 
 pt_node_t* pt_integer_new(int integer)
 {
-  pt_int_value_t* new_node = (pt_int_value_t*) calloc(1,sizeof(pt_int_value_t));
+  pt_int_value_t* new_node = (pt_int_value_t*) slab_alloc(sizeof(pt_int_value_t));
   new_node->parent.type = PT_INTEGER;
   new_node->value = integer;
   return (pt_node_t*) new_node;
@@ -354,7 +1252,7 @@ pt_node_t* pt_integer_new(int integer)
 
 pt_node_t* pt_double_new(double dbl)
 {
-  pt_double_value_t* new_node = (pt_double_value_t*) calloc(1,sizeof(pt_double_value_t));
+  pt_double_value_t* new_node = (pt_double_value_t*) slab_alloc(sizeof(pt_double_value_t));
   new_node->parent.type = PT_DOUBLE;
   new_node->value = dbl;
   return (pt_node_t*) new_node;
@@ -362,7 +1260,7 @@ pt_node_t* pt_double_new(double dbl)
 
 void pt_map_set(pt_node_t* map, const char* key, pt_node_t* value)
 {
-  if (map && map->type == PT_MAP && key && value) {
+  if (map && map->type == PT_MAP && !arena_read_only(map,"pt_map_set") && key && value) {
     pt_map_t* real_map = (pt_map_t*) map;
     pt_key_value_t* search_result = NULL;
     HASH_FIND(hh,real_map->key_values,key,strlen(key),search_result);
@@ -371,7 +1269,7 @@ void pt_map_set(pt_node_t* map, const char* key, pt_node_t* value)
       pt_free_node(search_result->value);
       search_result->value = value;
     } else {
-      pt_key_value_t* new_node = (pt_key_value_t*) calloc(1,sizeof(pt_key_value_t));
+      pt_key_value_t* new_node = (pt_key_value_t*) slab_alloc(sizeof(pt_key_value_t));
       char* new_key = strdup(key);
       new_node->parent.type = PT_KEY_VALUE;
       new_node->key = new_key;
@@ -383,22 +1281,23 @@ void pt_map_set(pt_node_t* map, const char* key, pt_node_t* value)
 
 void pt_map_unset(pt_node_t* map, const char* key)
 {
-  if (map && map->type == PT_MAP) {
+  if (map && map->type == PT_MAP && !arena_read_only(map,"pt_map_unset")) {
     pt_map_t* real_map = (pt_map_t*) map;
     pt_key_value_t* search_result = NULL;
     HASH_FIND(hh,real_map->key_values,key,strlen(key),search_result);
     if (search_result) {
       HASH_DEL(real_map->key_values,search_result);
       pt_free_node(search_result->value);
-      free(search_result->key);
-      free(search_result);
+      if (!(search_result->parent.flags & (PT_NODE_IN_SITU | PT_NODE_INTERNED)))
+        free(search_result->key);
+      slab_free(search_result);
     }
   }
 }
 
 pt_node_t* pt_string_new(const char* str)
 {
-  pt_str_value_t* new_node = (pt_str_value_t*) calloc(1,sizeof(pt_str_value_t));
+  pt_str_value_t* new_node = (pt_str_value_t*) slab_alloc(sizeof(pt_str_value_t));
   new_node->parent.type = PT_STRING;
   new_node->value = strdup(str);
   return (pt_node_t*) new_node;
@@ -406,7 +1305,7 @@ pt_node_t* pt_string_new(const char* str)
 
 pt_node_t* pt_array_new()
 {
-  pt_node_t* new_node = (pt_node_t*) calloc(1,sizeof(pt_array_t));
+  pt_node_t* new_node = (pt_node_t*) slab_alloc(sizeof(pt_array_t));
   new_node->type = PT_ARRAY;
   TAILQ_INIT(&((pt_array_t*) new_node)->head);
   return new_node;
@@ -414,14 +1313,8 @@ pt_node_t* pt_array_new()
 
 char* pt_to_json(pt_node_t* root, int beautify)
 {
-#ifdef HAVE_YAJL_V2
-  yajl_gen g = yajl_gen_alloc(NULL);
-  yajl_gen_config(g, yajl_gen_beautify, beautify);
-  yajl_gen_config(g, yajl_gen_indent_string, "  ");
-#else
-  yajl_gen_config conf = { beautify,"  "};
-  yajl_gen g = yajl_gen_alloc(&conf, NULL);
-#endif
+  unsigned long long start = metrics_start();
+  yajl_gen g = new_generator(beautify);
 
   generate_node_json(root,g);
 
@@ -440,18 +1333,98 @@ char* pt_to_json(pt_node_t* root, int beautify)
   json[len] = '\0';
 
   yajl_gen_free(g);
+  metrics_stop(PT_METRIC_GENERATE,start);
   return json;
 }
 
 pt_node_t* pt_from_json(const char* json)
 {
-  pt_node_t* root = parse_json(json,strlen(json));
+  pt_node_t* root = parse_json(json,strlen(json),NULL,0,0);
   return root;
 }
 
 int pt_map_update(pt_node_t* root, pt_node_t* additions, int append)
 {
-  if (!root || !additions || root->type != PT_MAP || additions->type != PT_MAP)
+  unsigned long long start = metrics_start();
+  int ret = map_update(root,additions,append);
+  metrics_stop(PT_METRIC_MERGE,start);
+  return ret;
+}
+
+pt_node_t* pt_clone(pt_node_t* root)
+{
+  unsigned long long start = metrics_start();
+  pt_node_t* clone = clone_node(root);
+  metrics_stop(PT_METRIC_CLONE,start);
+  return clone;
+}
+
+void pt_metrics_enable(int enabled)
+{
+  __atomic_store_n(&metrics_enabled,enabled != 0,__ATOMIC_RELAXED);
+}
+
+pt_metrics_t* pt_metrics_snapshot()
+{
+  pt_metrics_t* metrics = (pt_metrics_t*) calloc(1,sizeof(pt_metrics_t));
+  pt_metrics_shard_t* shard;
+  int i, j;
+  for(shard = __atomic_load_n(&metrics_shards,__ATOMIC_ACQUIRE); shard; shard = shard->next) {
+    for(i = 0; i < PT_METRIC_COUNT; i++) {
+      pt_histogram_t* from = &shard->histograms[i];
+      pt_histogram_t* to = &metrics->histograms[i];
+      unsigned long long count = __atomic_load_n(&from->count,__ATOMIC_RELAXED);
+      if (!count)
+        continue;
+      unsigned long long min_us = __atomic_load_n(&from->min_us,__ATOMIC_RELAXED);
+      unsigned long long max_us = __atomic_load_n(&from->max_us,__ATOMIC_RELAXED);
+      if (!to->count || min_us < to->min_us)
+        to->min_us = min_us;
+      if (max_us > to->max_us)
+        to->max_us = max_us;
+      to->count += count;
+      to->total_us += __atomic_load_n(&from->total_us,__ATOMIC_RELAXED);
+      for(j = 0; j < PT_HISTOGRAM_BUCKETS; j++)
+        to->buckets[j] += __atomic_load_n(&from->buckets[j],__ATOMIC_RELAXED);
+    }
+    for(i = 0; i < PT_COUNTER_COUNT; i++)
+      metrics->counters[i] += __atomic_load_n(&shard->counters[i],__ATOMIC_RELAXED);
+  }
+  return metrics;
+}
+
+void pt_free_metrics(pt_metrics_t* metrics)
+{
+  free(metrics);
+}
+
+unsigned long long pt_histogram_percentile(const pt_histogram_t* histogram, double percentile)
+{
+  unsigned long long seen = 0, total = 0;
+  unsigned int i;
+  for(i = 0; i < PT_HISTOGRAM_BUCKETS; i++)
+    total += histogram->buckets[i];
+  if (!total)
+    return 0;
+
+  // the rank of the value we're after, counting from 1
+  unsigned long long rank = (unsigned long long) (percentile / 100.0 * total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > total)
+    rank = total;
+  for(i = 0; i < PT_HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  unsigned long long value = histogram_bucket_value(i);
+  return value > histogram->max_us ? histogram->max_us : value;
+}
+
+static int map_update(pt_node_t* root, pt_node_t* additions, int append)
+{
+  if (!root || !additions || root->type != PT_MAP || additions->type != PT_MAP || arena_read_only(root,"pt_map_update"))
     return 1;
 
   //pt_map_t* root_map = (pt_map_t*) root;
@@ -461,17 +1434,17 @@ int pt_map_update(pt_node_t* root, pt_node_t* additions, int append)
     if (key_value->value) {
       pt_node_t* existing = pt_map_get(root,key_value->key);
       if (!existing) {
-        pt_map_set(root,key_value->key,pt_clone(key_value->value));
+        pt_map_set(root,key_value->key,clone_node(key_value->value));
       } else {
         if (key_value->value->type != existing->type) {
           return 1;
         }
         switch(key_value->value->type) {
           case PT_MAP:
-            pt_map_update(existing,key_value->value,append);
+            map_update(existing,key_value->value,append);
             break;
           default:
-            pt_map_set(root,key_value->key,pt_clone(key_value->value));
+            pt_map_set(root,key_value->key,clone_node(key_value->value));
             break;
         }
       }
@@ -480,7 +1453,7 @@ int pt_map_update(pt_node_t* root, pt_node_t* additions, int append)
   return 0;
 }
 
-pt_node_t* pt_clone(pt_node_t* root)
+static pt_node_t* clone_node(pt_node_t* root)
 {
   if (root) {
     switch(root->type) {
@@ -490,7 +1463,7 @@ pt_node_t* pt_clone(pt_node_t* root)
           pt_map_t* map = (pt_map_t*) root;
           pt_key_value_t* key_value = NULL;
           for(key_value = map->key_values; key_value != NULL; key_value = key_value->hh.next) {
-            pt_map_set(clone,key_value->key,pt_clone(key_value->value));
+            pt_map_set(clone,key_value->key,clone_node(key_value->value));
           }
           return (pt_node_t*) clone;
         }
@@ -500,7 +1473,7 @@ pt_node_t* pt_clone(pt_node_t* root)
           pt_array_t* array = (pt_array_t*) root;
           pt_array_elem_t* elem = TAILQ_FIRST(&array->head);
           while(elem) {
-            pt_array_push_back(clone,pt_clone(elem->node));
+            pt_array_push_back(clone,clone_node(elem->node));
             elem = TAILQ_NEXT(elem,entries);
           }
           return clone;
@@ -528,97 +1501,1567 @@ pt_node_t* pt_clone(pt_node_t* root)
 /*
  * This method wraps basic curl functionality
  */
-static pt_response_t* http_operation(const char* http_method, const char* server_target, const char* data, unsigned data_len)
+static pt_response_t* http_operation(pt_session_impl_t* session, const char* http_method, const char* server_target, const char* data, unsigned data_len, int parse)
 {
-  CURL *curl_handle;
+  if (session && session->coalesce_gets && parse && !strcmp("GET",http_method))
+    return coalesced_get(session,server_target);
+  return http_perform(session,http_method,server_target,data,data_len,parse);
+}
+
+static pt_response_t* http_perform(pt_session_impl_t* session, const char* http_method, const char* server_target, const char* data, unsigned data_len, int parse)
+{
+  pt_request_t* req = request_new(session,http_method,server_target,data,data_len,parse);
   CURLcode ret;
-  struct memory_chunk recv_chunk;
-  recv_chunk.memory=NULL; /* we expect realloc(NULL, size) to work */
-  recv_chunk.size = 0;    /* no data at this point */
+  long delay_ms;
+  if (parse && req->method_metric == PT_METRIC_GET)
+    request_use_cache(req,server_target);
 
-  struct memory_chunk send_chunk = {0,0,0};
+  /* get it! */
+  for(;;) {
+    ret = req->hedge_url ? request_perform_hedged(req) : curl_easy_perform(req->handle->curl);
+    if ((delay_ms = request_retry_delay(req,ret)) < 0)
+      break;
+    sleep_ms(delay_ms);
+    request_rewind(req);
+  }
 
-  /* init the curl session */
-  curl_handle = curl_easy_init();
+  return request_finish(req,ret);
+}
+
+/*
+ * Singleflight: the first thread to GET a url makes the request, and any
+ * that ask for it before it finishes wait for its response.  The response
+ * is shared while the waiters copy it, and freed by whoever is done last.
+ */
+static pt_response_t* coalesced_get(pt_session_impl_t* session, const char* server_target)
+{
+  pt_flight_t* flight = NULL;
+  pt_response_t* res;
+  int waiting;
+
+  pthread_mutex_lock(&session->lock);
+  HASH_FIND(hh,session->flights,server_target,strlen(server_target),flight);
+  if (flight) {
+    flight->refs++;
+    while (!flight->finished)
+      pthread_cond_wait(&flight->finished_cond,&session->lock);
+    pthread_mutex_unlock(&session->lock);
+    metrics_count(PT_COUNTER_COALESCED,1);
+    res = response_clone(flight->res);
+  } else {
+    flight = (pt_flight_t*) calloc(1,sizeof(pt_flight_t));
+    flight->url = strdup(server_target);
+    flight->refs = 1;
+    pthread_cond_init(&flight->finished_cond,NULL);
+    HASH_ADD_KEYPTR(hh,session->flights,flight->url,strlen(flight->url),flight);
+    pthread_mutex_unlock(&session->lock);
+
+    res = http_perform(session,"GET",server_target,NULL,0,1);
+
+    pthread_mutex_lock(&session->lock);
+    // later callers start a new request rather than getting this one
+    HASH_DEL(session->flights,flight);
+    waiting = flight->refs > 1;
+    flight->res = res;
+    flight->finished = 1;
+    pthread_cond_broadcast(&flight->finished_cond);
+    pthread_mutex_unlock(&session->lock);
+    // nobody else saw it, so there's nothing to share
+    if (!waiting) {
+      pthread_cond_destroy(&flight->finished_cond);
+      free(flight->url);
+      free(flight);
+      return res;
+    }
+    res = response_clone(res);
+  }
+
+  pthread_mutex_lock(&session->lock);
+  int last = --flight->refs == 0;
+  pthread_mutex_unlock(&session->lock);
+  if (last) {
+    pt_free_response(flight->res);
+    pthread_cond_destroy(&flight->finished_cond);
+    free(flight->url);
+    free(flight);
+  }
+  return res;
+}
+
+/* A response of its own for each thread that shared a coalesced GET */
+static pt_response_t* response_clone(pt_response_t* res)
+{
+  pt_response_impl_t* impl = (pt_response_impl_t*) calloc(1,sizeof(pt_response_impl_t));
+  pt_response_t* copy = &impl->response;
+  copy->response_code = res->response_code;
+  copy->timing = res->timing;
+  copy->root = clone_node(res->root);
+  if (res->raw_json) {
+    copy->raw_json = (char*) malloc(res->raw_json_len + 1);
+    memcpy(copy->raw_json,res->raw_json,res->raw_json_len + 1);
+    copy->raw_json_len = res->raw_json_len;
+  }
+  return copy;
+}
+
+/*
+ * Build a request on a pooled handle with everything set up except actually
+ * running it, which is either curl_easy_perform or the session's multi handle
+ */
+static pt_request_t* request_new(pt_session_impl_t* session, const char* http_method, const char* server_target, const char* data, unsigned data_len, int parse)
+{
+  pt_request_t* req = (pt_request_t*) calloc(1,sizeof(pt_request_t));
+  CURL *curl_handle;
+  req->session = session;
+  req->parse = parse;
+  req->retain_raw = 1;
+  req->start_us = metrics_start();
+  if (!strcmp("GET",http_method))
+    req->method_metric = PT_METRIC_GET;
+  else if (!strcmp("PUT",http_method))
+    req->method_metric = PT_METRIC_PUT;
+  else if (!strcmp("POST",http_method))
+    req->method_metric = PT_METRIC_POST;
+  else if (!strcmp("DELETE",http_method))
+    req->method_metric = PT_METRIC_DELETE;
+  else
+    req->method_metric = PT_METRIC_OTHER_METHOD;
+  if (session) {
+    pthread_mutex_lock(&session->lock);
+    req->pool = session->buffer_pool;
+    if (req->pool)
+      buffer_pool_retain(req->pool);
+    pthread_mutex_unlock(&session->lock);
+    if (session->timeout_ms)
+      req->deadline_ms = monotonic_ms() + session->timeout_ms;
+    req->idempotent = req->method_metric == PT_METRIC_GET;
+    if (req->idempotent) {
+      req->retries_left = session->retries;
+      if (session->hedge_percentile)
+        req->hedge_url = strdup(server_target);
+    }
+    if (session->cache_budget && (req->method_metric == PT_METRIC_PUT || req->method_metric == PT_METRIC_DELETE))
+      cache_remove(session,server_target);
+  }
+  if (parse && session && session->arena_parse)
+    req->arena = arena_new();
+  if (parse && session && session->stream_parse) {
+    req->parser = stream_parser_new();
+    req->parser->ctx->arena = req->arena;
+    req->parser->ctx->intern_keys = session->intern_keys;
+    req->retain_raw = session->retain_raw_json;
+  }
+
+  /* grab a warm handle for this host if the session has one */
+  req->handle = acquire_handle(session,server_target);
+  curl_handle = req->handle->curl;
+  if (session) {
+    curl_easy_setopt(curl_handle, CURLOPT_SHARE, session->share);
+    curl_easy_setopt(curl_handle, CURLOPT_MAXCONNECTS, session->max_connections);
+
+    switch(session->http_version) {
+      case PT_HTTP_DEFAULT:
+        break;
+      case PT_HTTP_1_1:
+        curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        break;
+      case PT_HTTP_2:
+        curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+        break;
+      case PT_HTTP_2_PRIOR_KNOWLEDGE:
+        curl_easy_setopt(curl_handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE);
+        break;
+    }
+    /*
+     * Rather than opening a second connection while the first is still
+     * connecting, wait to find out if it can take another stream
+     */
+    if (session->http_version >= PT_HTTP_2)
+      curl_easy_setopt(curl_handle, CURLOPT_PIPEWAIT, 1L);
+    // curl keeps its own copy of the path
+    pthread_mutex_lock(&session->lock);
+    if (session->unix_socket)
+      curl_easy_setopt(curl_handle, CURLOPT_UNIX_SOCKET_PATH, session->unix_socket);
+    pthread_mutex_unlock(&session->lock);
+  }
+
+  /* specify URL to get */
+  curl_easy_setopt(curl_handle, CURLOPT_URL, server_target);
+
+  curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT_MS,
+      session ? session->connect_timeout_ms : (long) PT_DEFAULT_CONNECT_TIMEOUT_MS);
+  request_set_timeout(req);
+
+  /*
+   * An empty string offers every encoding curl was built with.  curl inflates
+   * each piece as it arrives, so the write callback (and the stream parser)
+   * only ever see decoded data a chunk at a time.
+   */
+  if (session && session->accept_encoding)
+    curl_easy_setopt(curl_handle, CURLOPT_ACCEPT_ENCODING, "");
+
+  // Want to avoid CURL SIGNALS
+  curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
+
+  // Lets the multi interface find us again when the transfer is done
+  curl_easy_setopt(curl_handle, CURLOPT_PRIVATE, req);
+
+  PT_LOG(PT_LOG_DEBUG,"%s %s",http_method,server_target);
+
+  /*
+   * Bodies are sent straight out of the caller's buffer, which has to stay
+   * alive until the request is finished.  Giving curl the length up front
+   * gets us a Content-Length instead of chunked encoding, and the empty
+   * Expect header stops it from waiting on a 100-continue before sending.
+   */
+  int gzip = session && session->gzip_min_size && data && data_len >= session->gzip_min_size
+    && (!strcmp("PUT",http_method) || !strcmp("POST",http_method));
+  if (gzip && request_gzip_body(req,data,data_len)) {
+    // the compressed length isn't known until the end, so it goes out chunked
+    curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, send_gzip_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_READDATA, (void*) req);
+    curl_easy_setopt(curl_handle, CURLOPT_SEEKFUNCTION, send_gzip_seek);
+    curl_easy_setopt(curl_handle, CURLOPT_SEEKDATA, (void*) req);
+    if (!strcmp("PUT",http_method)) {
+      curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1);
+    } else {
+      curl_easy_setopt(curl_handle, CURLOPT_POST, 1);
+      req->headers = curl_slist_append(req->headers,"Content-Type: application/json");
+      req->headers = curl_slist_append(req->headers,"Transfer-Encoding: chunked");
+    }
+    req->headers = curl_slist_append(req->headers,"Content-Encoding: gzip");
+    req->headers = curl_slist_append(req->headers,"Expect:");
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, req->headers);
+  } else if (!strcmp("PUT",http_method)) {
+    req->send_chunk.offset = (char*) data;
+    req->send_chunk.size = data ? data_len : 0;
+    req->send_start = req->send_chunk.offset;
+    req->send_len = req->send_chunk.size;
+    curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1);
+    curl_easy_setopt(curl_handle, CURLOPT_INFILESIZE_LARGE, (curl_off_t) req->send_chunk.size);
+    curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, send_memory_callback);
+    curl_easy_setopt(curl_handle, CURLOPT_READDATA, (void*) &req->send_chunk);
+    // a pooled connection the server dropped gets the request resent on a new one
+    curl_easy_setopt(curl_handle, CURLOPT_SEEKFUNCTION, send_memory_seek);
+    curl_easy_setopt(curl_handle, CURLOPT_SEEKDATA, (void*) req);
+    req->headers = curl_slist_append(req->headers,"Expect:");
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, req->headers);
+  } else if (!strcmp("POST",http_method)) {
+    curl_easy_setopt(curl_handle, CURLOPT_POST, 1);
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, data ? data : "");
+    curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t) (data ? data_len : 0));
+    // CouchDB refuses POSTed json without the right content type
+    req->headers = curl_slist_append(req->headers,"Content-Type: application/json");
+    req->headers = curl_slist_append(req->headers,"Expect:");
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, req->headers);
+  } else {
+    curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, http_method);
+  }
+
+  /* send all data to this function  */
+  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, recv_memory_callback);
+
+  /* we pass our request to the callback function */
+  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)req);
+
+  /* some servers don't like requests that are made without a user-agent
+     field, so we provide one */
+  curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "pillowtalk-agent/0.1");
+
+  return req;
+}
+
+/*
+ * Turn a completed transfer into a pt_response_t and give the handle back to
+ * the session.  The request is freed.
+ */
+static pt_response_t* request_finish(pt_request_t* req, CURLcode ret)
+{
+  pt_response_impl_t* impl = (pt_response_impl_t*) calloc(1,sizeof(pt_response_impl_t));
+  pt_response_t* res = &impl->response;
+  if ((!ret)) {
+    ret = curl_easy_getinfo(req->handle->curl,CURLINFO_RESPONSE_CODE, &res->response_code);
+    if (ret != CURLE_OK)
+      res->response_code = 500;
+
+    if (req->recv_chunk.size > 0) {
+      // Parse the JSON chunk returned
+      req->recv_chunk.memory[req->recv_chunk.size] = '\0';
+      res->raw_json = req->recv_chunk.memory;
+      res->raw_json_len = req->recv_chunk.size;
+      impl->raw_json_capacity = req->recv_chunk.capacity;
+      if (req->pool) {
+        impl->pool = req->pool;
+        buffer_pool_retain(impl->pool);
+      }
+      req->recv_chunk.memory = NULL;
+    }
+  } else {
+    res->response_code = 500;
+    if (PT_LOG_ENABLED(PT_LOG_WARN)) {
+      char* url = NULL;
+      curl_easy_getinfo(req->handle->curl,CURLINFO_EFFECTIVE_URL,&url);
+      log_write(PT_LOG_WARN,"%s failed: %s",url ? url : "request",curl_easy_strerror(ret));
+    }
+  }
+
+  double start = monotonic_seconds();
+  if (req->parser) {
+    res->root = stream_parser_finish(req->parser);
+    req->parser = NULL;
+    req->parse_time += monotonic_seconds() - start;
+    // parse_json records itself, a streamed parse is only known here
+    if (req->start_us)
+      metrics_record(PT_METRIC_PARSE,(unsigned long long) (req->parse_time * 1e6));
+  } else if (req->parse) {
+    int in_situ = req->session && req->session->in_situ_strings && res->raw_json;
+    res->root = parse_json(res->raw_json,res->raw_json_len,req->arena,in_situ,req->session && req->session->intern_keys);
+    req->parse_time += monotonic_seconds() - start;
+    // the body now has holes punched in it, so it's only there for the tree
+    if (in_situ) {
+      impl->body = res->raw_json;
+      res->raw_json = NULL;
+      res->raw_json_len = 0;
+    }
+  }
+  if (res->root && PT_IN_ARENA(res->root)) {
+    impl->arena = req->arena;
+    req->arena = NULL;
+  }
+  if (req->cache_url && ret == CURLE_OK)
+    request_cache_result(req,res);
+  request_timing(req,&res->timing);
+  if (req->hedge_url && ret == CURLE_OK && res->response_code < 500)
+    session_record_get(req->session,res->timing.total);
+
+  if (req->start_us) {
+    long connects = 0;
+    curl_easy_getinfo(req->handle->curl,CURLINFO_NUM_CONNECTS,&connects);
+    metrics_stop(req->method_metric,req->start_us);
+    metrics_count(PT_COUNTER_REQUESTS,1);
+    if (ret != CURLE_OK || res->response_code >= 500)
+      metrics_count(PT_COUNTER_ERRORS,1);
+    metrics_count(PT_COUNTER_BYTES_SENT,res->timing.bytes_sent);
+    metrics_count(PT_COUNTER_BYTES_RECEIVED,res->timing.bytes_received);
+    if (connects > 0)
+      metrics_count(PT_COUNTER_CONNECTIONS_OPENED,connects);
+    else if (ret == CURLE_OK)
+      metrics_count(PT_COUNTER_CONNECTIONS_REUSED,1);
+  }
+
+  /* hand the handle (and its open connection) back to the session */
+  if (req->cut_short)
+    free_pooled_handle(req->handle);
+  else
+    release_handle(req->session,req->handle);
+  request_free(req);
+  return res;
+}
+
+static void request_free(pt_request_t* req)
+{
+  if (req->parser)
+    pt_free_node(stream_parser_finish(req->parser));
+  if (req->arena)
+    arena_free(req->arena);
+  if (req->headers)
+    curl_slist_free_all(req->headers);
+  if (req->gzip) {
+    deflateEnd(req->gzip);
+    free(req->gzip);
+  }
+  if (req->pool) {
+    buffer_pool_put(req->pool,req->recv_chunk.memory,req->recv_chunk.capacity);
+    buffer_pool_release(req->pool);
+  } else {
+    free(req->recv_chunk.memory);
+  }
+  free(req->send_chunk.memory);
+  if (req->mapped)
+    munmap(req->mapped,req->mapped_len);
+  free(req->hedge_url);
+  free(req->cache_url);
+  free(req->etag);
+  if (req->cached)
+    cache_release(req->session,req->cached);
+  free(req);
+}
+
+/* Bound the next attempt by what is left of the request's deadline */
+static void request_set_timeout(pt_request_t* req)
+{
+  long timeout_ms = 0;
+  if (req->deadline_ms) {
+    timeout_ms = (long) (req->deadline_ms - monotonic_ms());
+    // curl takes 0 to mean no timeout at all
+    if (timeout_ms < 1)
+      timeout_ms = 1;
+  }
+  curl_easy_setopt(req->handle->curl, CURLOPT_TIMEOUT_MS, timeout_ms);
+}
+
+/*
+ * How long to wait before trying a failed request again, or -1 to give up.
+ * The wait is a random time up to the backoff doubled for each attempt so
+ * far, which keeps clients that failed together from retrying together.
+ */
+static long request_retry_delay(pt_request_t* req, CURLcode ret)
+{
+  long code = 0;
+  if (req->retries_left <= 0)
+    return -1;
+  switch(ret) {
+    case CURLE_OK:
+      curl_easy_getinfo(req->handle->curl,CURLINFO_RESPONSE_CODE,&code);
+      if (code != 502 && code != 503 && code != 504)
+        return -1;
+      break;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+      break;
+    default:
+      return -1;
+  }
+
+  long ceiling = req->session->retry_backoff_ms << (req->attempts < 10 ? req->attempts : 10);
+  if (ceiling > PT_RETRY_BACKOFF_MAX_MS)
+    ceiling = PT_RETRY_BACKOFF_MAX_MS;
+  if (!retry_seed)
+    retry_seed = (unsigned int) (monotonic_us() ^ (unsigned long) pthread_self());
+  long delay_ms = ceiling > 0 ? rand_r(&retry_seed) % (ceiling + 1) : 0;
+  if (req->deadline_ms && monotonic_ms() + delay_ms >= req->deadline_ms)
+    return -1;
+
+  req->retries_left--;
+  req->attempts++;
+  metrics_count(PT_COUNTER_RETRIES,1);
+  if (PT_LOG_ENABLED(PT_LOG_INFO)) {
+    char* url = NULL;
+    curl_easy_getinfo(req->handle->curl,CURLINFO_EFFECTIVE_URL,&url);
+    if (code)
+      log_write(PT_LOG_INFO,"retrying %s in %ldms after a %ld",url ? url : "request",delay_ms,code);
+    else
+      log_write(PT_LOG_INFO,"retrying %s in %ldms: %s",url ? url : "request",delay_ms,curl_easy_strerror(ret));
+  }
+  return delay_ms;
+}
+
+/* Throw away what a failed attempt received so the request can go again */
+static void request_rewind(pt_request_t* req)
+{
+  req->recv_chunk.size = 0;
+  free(req->etag);
+  req->etag = NULL;
+  if (req->parser)
+    pt_free_node(stream_parser_finish(req->parser));
+  if (req->arena) {
+    arena_free(req->arena);
+    req->arena = arena_new();
+  }
+  if (req->parser) {
+    req->parser = stream_parser_new();
+    req->parser->ctx->arena = req->arena;
+    req->parser->ctx->intern_keys = req->session && req->session->intern_keys;
+  }
+  request_set_timeout(req);
+}
+
+/* For requests whose output goes somewhere it can't be taken back from */
+static void request_no_replay(pt_request_t* req)
+{
+  req->idempotent = 0;
+  req->retries_left = 0;
+  free(req->hedge_url);
+  req->hedge_url = NULL;
+}
+
+/*
+ * Run a GET, and once it has taken longer than the session's hedge
+ * percentile, race a second copy against it.  Whichever copy finishes first
+ * ends up in req.
+ */
+static CURLcode request_perform_hedged(pt_request_t* req)
+{
+  long delay_ms = session_hedge_delay_ms(req->session);
+  if (delay_ms < 0)
+    return curl_easy_perform(req->handle->curl);
+
+  // the handles may trade places once the race is settled, so hold on to this one's multi
+  if (!req->handle->multi)
+    req->handle->multi = curl_multi_init();
+  CURLM* multi = req->handle->multi;
+  CURLcode ret = CURLE_OK;
+  pt_request_t* winner = NULL;
+  pt_request_t* failed = NULL;
+  long long hedge_at = monotonic_ms() + delay_ms;
+  int running;
+  curl_multi_add_handle(multi,req->handle->curl);
+  for(;;) {
+    CURLMsg* msg;
+    int msgs_left;
+    curl_multi_perform(multi,&running);
+    while (!winner && (msg = curl_multi_info_read(multi,&msgs_left))) {
+      if (msg->msg == CURLMSG_DONE) {
+        pt_request_t* done = NULL;
+        curl_easy_getinfo(msg->easy_handle,CURLINFO_PRIVATE,(char**) &done);
+        // a copy that failed only loses if the other one can still come through
+        if (msg->data.result != CURLE_OK && req->twin && !failed) {
+          failed = done;
+          curl_multi_remove_handle(multi,msg->easy_handle);
+          continue;
+        }
+        winner = done;
+        ret = msg->data.result;
+      }
+    }
+    if (winner)
+      break;
+
+    long long now = monotonic_ms();
+    if (!req->twin && now >= hedge_at) {
+      curl_multi_add_handle(multi,request_hedge(req)->handle->curl);
+      continue;
+    }
+    curl_multi_wait(multi,NULL,0,req->twin ? 1000 : (int) (hedge_at - now),NULL);
+  }
+
+  if (req != failed)
+    curl_multi_remove_handle(multi,req->handle->curl);
+  if (req->twin) {
+    if (req->twin != failed)
+      curl_multi_remove_handle(multi,req->twin->handle->curl);
+    request_settle_hedge(req,winner);
+  }
+  return ret;
+}
+
+/* A second copy of a slow GET, to race against the first */
+static pt_request_t* request_hedge(pt_request_t* req)
+{
+  pt_request_t* twin = request_new(req->session,"GET",req->hedge_url,NULL,0,req->parse);
+  twin->retain_raw = req->retain_raw;
+  twin->deadline_ms = req->deadline_ms;
+  twin->retries_left = 0;
+  request_set_timeout(twin);
+  twin->is_twin = 1;
+  if (req->cache_url)
+    request_use_cache(twin,req->cache_url);
+  twin->twin = req;
+  req->twin = twin;
+  metrics_count(PT_COUNTER_HEDGES,1);
+  PT_LOG(PT_LOG_INFO,"hedging slow GET %s",req->hedge_url);
+  return twin;
+}
+
+/*
+ * Keep whichever copy of a hedged GET won in req, the one the caller knows
+ * about, and throw the other away.  Both have to be off any multi handle.
+ * The loser is cut off mid transfer, so its connection is closed rather than
+ * going back to the pool.
+ */
+static void request_settle_hedge(pt_request_t* req, pt_request_t* winner)
+{
+  pt_request_t* twin = req->twin;
+  if (winner == twin) {
+    pt_pooled_handle_t* handle = req->handle;
+    struct memory_chunk recv_chunk = req->recv_chunk;
+    pt_stream_parser_t* parser = req->parser;
+    pt_arena_t* arena = req->arena;
+    double parse_time = req->parse_time;
+    char* etag = req->etag;
+    req->handle = twin->handle;
+    req->recv_chunk = twin->recv_chunk;
+    req->parser = twin->parser;
+    req->arena = twin->arena;
+    req->parse_time = twin->parse_time;
+    req->etag = twin->etag;
+    twin->handle = handle;
+    twin->recv_chunk = recv_chunk;
+    twin->parser = parser;
+    twin->arena = arena;
+    twin->parse_time = parse_time;
+    twin->etag = etag;
+    // in case req goes round again for a retry
+    curl_easy_setopt(req->handle->curl, CURLOPT_PRIVATE, req);
+    curl_easy_setopt(req->handle->curl, CURLOPT_WRITEDATA, (void*) req);
+    if (req->cache_url)
+      curl_easy_setopt(req->handle->curl, CURLOPT_HEADERDATA, (void*) req);
+  }
+  req->twin = NULL;
+  req->hedge_at_ms = 0;
+  free_pooled_handle(twin->handle);
+  request_free(twin);
+}
+
+/* Add a finished GET's time to what the session's hedge delay comes from */
+static void session_record_get(pt_session_impl_t* session, double seconds)
+{
+  pt_histogram_t* latency = &session->get_latency;
+  unsigned long long us = (unsigned long long) (seconds * 1e6);
+  unsigned int i;
+  pthread_mutex_lock(&session->lock);
+  // halve the old counts now and then so the delay follows the server
+  if (latency->count >= PT_HEDGE_WINDOW) {
+    latency->count = 0;
+    for(i = 0; i < PT_HISTOGRAM_BUCKETS; i++) {
+      latency->buckets[i] /= 2;
+      latency->count += latency->buckets[i];
+    }
+  }
+  latency->buckets[histogram_bucket(us)]++;
+  latency->count++;
+  if (us > latency->max_us)
+    latency->max_us = us;
+  pthread_mutex_unlock(&session->lock);
+}
+
+/*
+ * How long a GET runs before it is hedged, or -1 until there is enough to go
+ * on.  Rounded up, so sub-millisecond percentiles don't hedge straight away.
+ */
+static long session_hedge_delay_ms(pt_session_impl_t* session)
+{
+  long delay_ms = -1;
+  pthread_mutex_lock(&session->lock);
+  if (session->get_latency.count >= PT_HEDGE_MIN_SAMPLES)
+    delay_ms = (long) ((pt_histogram_percentile(&session->get_latency,session->hedge_percentile) + 999) / 1000);
+  pthread_mutex_unlock(&session->lock);
+  if (delay_ms >= 0 && delay_ms < PT_HEDGE_MIN_DELAY_MS)
+    delay_ms = PT_HEDGE_MIN_DELAY_MS;
+  return delay_ms;
+}
+
+/*
+ * Let a parsed GET be answered out of the session's cache: if there is a
+ * copy of url, ask the server whether it is still current, and either way
+ * catch the ETag of what comes back
+ */
+static void request_use_cache(pt_request_t* req, const char* url)
+{
+  pt_session_impl_t* session = req->session;
+  CURL* curl_handle = req->handle->curl;
+  if (!session || !session->cache_budget)
+    return;
+
+  req->cache_url = strdup(url);
+  req->cached = cache_lookup(session,url);
+  if (req->cached) {
+    char* header = (char*) malloc(strlen(req->cached->etag) + sizeof("If-None-Match: "));
+    sprintf(header,"If-None-Match: %s",req->cached->etag);
+    req->headers = curl_slist_append(req->headers,header);
+    free(header);
+    curl_easy_setopt(curl_handle, CURLOPT_HTTPHEADER, req->headers);
+  }
+  curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, recv_header_callback);
+  curl_easy_setopt(curl_handle, CURLOPT_HEADERDATA, (void*) req);
+}
+
+/*
+ * A 304 gets a copy of the cached tree, and a fresh tree with an ETag
+ * replaces whatever was cached.  The cache keeps its own copy so callers can
+ * change or free theirs.
+ */
+static void request_cache_result(pt_request_t* req, pt_response_t* res)
+{
+  if (res->response_code == 304 && req->cached) {
+    metrics_count(PT_COUNTER_CACHE_HITS,1);
+    pt_free_node(res->root);
+    res->root = clone_node(req->cached->root);
+    res->response_code = 200;
+    return;
+  }
+  metrics_count(PT_COUNTER_CACHE_MISSES,1);
+  if (res->response_code == 200 && req->etag && res->root)
+    cache_store(req->session,req->cache_url,req->etag,clone_node(res->root));
+  else if (req->cached)
+    cache_remove(req->session,req->cache_url);
+}
+
+/* The cached copy of url with a reference for the caller, or NULL */
+static pt_cache_entry_t* cache_lookup(pt_session_impl_t* session, const char* url)
+{
+  pt_cache_entry_t* entry = NULL;
+  pthread_mutex_lock(&session->lock);
+  HASH_FIND(hh,session->cache,url,strlen(url),entry);
+  if (entry) {
+    entry->refs++;
+    DL_DELETE(session->cache_lru,entry);
+    DL_PREPEND(session->cache_lru,entry);
+  }
+  pthread_mutex_unlock(&session->lock);
+  return entry;
+}
+
+/* Cache root, which the cache takes over, pushing out old entries to fit */
+static void cache_store(pt_session_impl_t* session, const char* url, const char* etag, pt_node_t* root)
+{
+  pt_cache_entry_t* entry = (pt_cache_entry_t*) calloc(1,sizeof(pt_cache_entry_t));
+  pt_cache_entry_t* old = NULL;
+  entry->url = strdup(url);
+  entry->etag = strdup(etag);
+  entry->root = root;
+  entry->refs = 1;
+  entry->bytes = sizeof(pt_cache_entry_t) + strlen(url) + strlen(etag) + 2 + node_bytes(root);
+
+  pthread_mutex_lock(&session->lock);
+  HASH_FIND(hh,session->cache,url,strlen(url),old);
+  if (old)
+    cache_unlink(session,old);
+  if (entry->bytes <= session->cache_budget) {
+    HASH_ADD_KEYPTR(hh,session->cache,entry->url,strlen(entry->url),entry);
+    DL_PREPEND(session->cache_lru,entry);
+    session->cache_used += entry->bytes;
+    while (session->cache_used > session->cache_budget)
+      cache_unlink(session,session->cache_lru->prev);
+    entry = NULL;
+  }
+  pthread_mutex_unlock(&session->lock);
+  // too big to keep at all
+  if (entry)
+    cache_entry_free(entry);
+}
+
+static void cache_remove(pt_session_impl_t* session, const char* url)
+{
+  pt_cache_entry_t* entry = NULL;
+  pthread_mutex_lock(&session->lock);
+  HASH_FIND(hh,session->cache,url,strlen(url),entry);
+  if (entry)
+    cache_unlink(session,entry);
+  pthread_mutex_unlock(&session->lock);
+}
+
+/* Drop least recently used entries until the cache fits in budget */
+static void cache_trim(pt_session_impl_t* session, size_t budget)
+{
+  pthread_mutex_lock(&session->lock);
+  while (session->cache_lru && session->cache_used > budget)
+    cache_unlink(session,session->cache_lru->prev);
+  pthread_mutex_unlock(&session->lock);
+}
+
+/* Take an entry out of the cache, with the lock held */
+static void cache_unlink(pt_session_impl_t* session, pt_cache_entry_t* entry)
+{
+  HASH_DEL(session->cache,entry);
+  DL_DELETE(session->cache_lru,entry);
+  session->cache_used -= entry->bytes;
+  if (--entry->refs == 0)
+    cache_entry_free(entry);
+}
+
+/* Give back the reference from cache_lookup */
+static void cache_release(pt_session_impl_t* session, pt_cache_entry_t* entry)
+{
+  pthread_mutex_lock(&session->lock);
+  int unused = --entry->refs == 0;
+  pthread_mutex_unlock(&session->lock);
+  if (unused)
+    cache_entry_free(entry);
+}
+
+static void cache_entry_free(pt_cache_entry_t* entry)
+{
+  pt_free_node(entry->root);
+  free(entry->url);
+  free(entry->etag);
+  free(entry);
+}
+
+/* About how much memory a tree takes up */
+static size_t node_bytes(pt_node_t* node)
+{
+  size_t bytes = 0;
+  if (!node)
+    return 0;
+  switch(node->type) {
+    case PT_MAP:
+      {
+        pt_key_value_t* key_value;
+        bytes = sizeof(pt_map_t);
+        for(key_value = ((pt_map_t*) node)->key_values; key_value != NULL; key_value = key_value->hh.next)
+          bytes += sizeof(pt_key_value_t) + strlen(key_value->key) + 1 + node_bytes(key_value->value);
+        return bytes;
+      }
+    case PT_ARRAY:
+      {
+        pt_array_elem_t* elem;
+        bytes = sizeof(pt_array_t);
+        TAILQ_FOREACH(elem,&((pt_array_t*) node)->head,entries)
+          bytes += sizeof(pt_array_elem_t) + node_bytes(elem->node);
+        return bytes;
+      }
+    case PT_STRING:
+      return sizeof(pt_str_value_t) + strlen(((pt_str_value_t*) node)->value) + 1;
+    case PT_DOUBLE:
+      return sizeof(pt_double_value_t);
+    default:
+      return sizeof(pt_int_value_t);
+  }
+}
+
+/*
+ * Queue a request on the session's multi handle, or park it until one of the
+ * in flight requests finishes if we are at the limit
+ */
+static pt_async_t* async_start(pt_session_impl_t* session, pt_request_t* req, pt_async_callback callback, void* userdata)
+{
+  req->callback = callback;
+  req->userdata = userdata;
+  if (!session->multi) {
+    session->multi = curl_multi_init();
+    curl_multi_setopt(session->multi,CURLMOPT_PIPELINING,CURLPIPE_MULTIPLEX);
+  }
+  DL_APPEND(session->pending,req);
+  session->pending_count++;
+  async_dispatch(session);
+  return (pt_async_t*) req;
+}
+
+/* Move pending requests onto the multi handle while there is room */
+static void async_dispatch(pt_session_impl_t* session)
+{
+  pt_request_t *req, *next;
+  long long now = monotonic_ms();
+  for(req = session->pending; req; req = next) {
+    if (session->max_inflight && session->inflight >= session->max_inflight)
+      break;
+    next = req->next;
+    // retries sit in the queue until their backoff is up
+    if (req->not_before_ms > now)
+      continue;
+    DL_DELETE(session->pending,req);
+    session->pending_count--;
+    req->in_multi = 1;
+    DL_APPEND(session->running,req);
+    session->inflight++;
+    // the deadline counts time spent queued
+    request_set_timeout(req);
+    if (req->hedge_url) {
+      long delay_ms = session_hedge_delay_ms(session);
+      req->hedge_at_ms = delay_ms >= 0 ? now + delay_ms : 0;
+    }
+    curl_multi_add_handle(session->multi,req->handle->curl);
+  }
+}
+
+/* Hand every finished transfer to its callback */
+static void async_complete(pt_session_impl_t* session)
+{
+  CURLMsg* msg;
+  int msgs_left;
+  while ((msg = curl_multi_info_read(session->multi,&msgs_left))) {
+    if (msg->msg == CURLMSG_DONE) {
+      pt_request_t* req = NULL;
+      CURL* curl_handle = msg->easy_handle;
+      CURLcode ret = msg->data.result;
+      curl_easy_getinfo(curl_handle,CURLINFO_PRIVATE,(char**) &req);
+      curl_multi_remove_handle(session->multi,curl_handle);
+      DL_DELETE(session->running,req);
+      session->inflight--;
+      req->in_multi = 0;
+
+      // a failed copy waits for the other one, which may still come through
+      if (ret != CURLE_OK && req->twin && req->twin->in_multi) {
+        req->parked = 1;
+        continue;
+      }
+      if (req->twin) {
+        pt_request_t* loser = req->twin;
+        if (loser->in_multi) {
+          curl_multi_remove_handle(session->multi,loser->handle->curl);
+          DL_DELETE(session->running,loser);
+          session->inflight--;
+          loser->in_multi = 0;
+        }
+        loser->parked = 0;
+        pt_request_t* winner = req;
+        req = req->is_twin ? loser : req;
+        request_settle_hedge(req,winner);
+      }
+
+      long delay_ms = request_retry_delay(req,ret);
+      if (delay_ms >= 0) {
+        request_rewind(req);
+        req->not_before_ms = monotonic_ms() + delay_ms;
+        DL_APPEND(session->pending,req);
+        session->pending_count++;
+        async_dispatch(session);
+        continue;
+      }
+
+      pt_async_callback callback = req->callback;
+      void* userdata = req->userdata;
+      pt_response_t* res = request_finish(req,ret);
+      async_dispatch(session);
+      if (callback)
+        callback(res,userdata);
+      else
+        pt_free_response(res);
+    }
+  }
+}
+
+/*
+ * Start retries whose backoff is over and second copies of GETs that have
+ * run past the hedge delay.  Returns how long pt_session_perform can wait,
+ * at most timeout_ms, before one of those needs doing.
+ */
+static long async_timers(pt_session_impl_t* session, long timeout_ms)
+{
+  pt_request_t* req;
+  long long now = monotonic_ms();
+  async_dispatch(session);
+  DL_FOREACH(session->running,req) {
+    if (!req->hedge_at_ms)
+      continue;
+    if (req->hedge_at_ms <= now) {
+      pt_request_t* twin = request_hedge(req);
+      req->hedge_at_ms = 0;
+      twin->in_multi = 1;
+      DL_APPEND(session->running,twin);
+      session->inflight++;
+      curl_multi_add_handle(session->multi,twin->handle->curl);
+    } else if (req->hedge_at_ms - now < timeout_ms) {
+      timeout_ms = (long) (req->hedge_at_ms - now);
+    }
+  }
+  DL_FOREACH(session->pending,req) {
+    if (req->not_before_ms > now && req->not_before_ms - now < timeout_ms)
+      timeout_ms = (long) (req->not_before_ms - now);
+  }
+  return timeout_ms;
+}
+
+static int changes_heartbeat_ms(const pt_changes_opts_t* opts)
+{
+  return opts->heartbeat_ms > 0 ? opts->heartbeat_ms : 30000;
+}
+
+static char* changes_url(const char* database_target, const pt_changes_opts_t* opts, const char* since)
+{
+  char* escaped_since = url_escape(since);
+  char* escaped_filter = opts->filter ? url_escape(opts->filter) : NULL;
+  size_t len = strlen(escaped_since) + (escaped_filter ? strlen(escaped_filter) : 0) + 128;
+  char* query = (char*) malloc(len);
+  snprintf(query,len,"_changes?feed=%s&heartbeat=%d&since=%s%s%s%s",
+      opts->longpoll ? "longpoll" : "continuous",changes_heartbeat_ms(opts),escaped_since,
+      opts->include_docs ? "&include_docs=true" : "",
+      escaped_filter ? "&filter=" : "", escaped_filter ? escaped_filter : "");
+  char* url = build_url(database_target,query);
+  free(query);
+  free(escaped_since);
+  free(escaped_filter);
+  return url;
+}
+
+/*
+ * Remember where the feed is up to and pass real changes on to the caller.
+ * The {"last_seq":...} line a continuous feed ends with only moves the seq.
+ */
+static int changes_dispatch(pt_changes_ctx_t* changes, pt_node_t* change)
+{
+  int stop = 0;
+  pt_node_t* seq = pt_map_get(change,"seq");
+  if (!seq)
+    seq = pt_map_get(change,"last_seq");
+  // reconnecting from a truncated seq would replay or skip changes
+  if (seq && seq->type == PT_INTEGER && (seq->flags & PT_NODE_TRUNCATED)) {
+    PT_LOG(PT_LOG_ERROR,"_changes seq is too big to resume from");
+    changes->seq_overflow = 1;
+    changes->stopped = 1;
+    return 1;
+  }
+  if (seq) {
+    free(changes->last_seq);
+    if (seq->type == PT_STRING) {
+      changes->last_seq = strdup(pt_string_get(seq));
+    } else if (seq->type == PT_INTEGER) {
+      changes->last_seq = (char*) malloc(32);
+      snprintf(changes->last_seq,32,"%d",pt_integer_get(seq));
+    } else {
+      changes->last_seq = pt_to_json(seq,0);
+    }
+  }
+  if (pt_map_get(change,"id"))
+    stop = changes->callback(change,changes->userdata);
+  if (stop)
+    changes->stopped = 1;
+  return stop;
+}
+
+/* Row callback for the results array of a longpoll response */
+static int changes_row(pt_node_t* row, void* data)
+{
+  int stop = changes_dispatch((pt_changes_ctx_t*) data,row);
+  pt_free_node(row);
+  return stop;
+}
+
+/*
+ * A continuous feed is one json object per line with blank heartbeat lines
+ * in between.  Each line gets its own parser, which is thrown away as soon
+ * as the line ends, so memory use doesn't grow with the length of the feed.
+ * A longpoll response is a single document whose results are streamed out
+ * one at a time.
+ */
+static size_t changes_recv_callback(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t realsize = size * nmemb;
+  pt_changes_ctx_t* changes = (pt_changes_ctx_t*) data;
+  const char* buf = (const char*) ptr;
+  size_t len = realsize;
+
+  // error bodies aren't changes
+  if (!changes->status)
+    curl_easy_getinfo(changes->curl,CURLINFO_RESPONSE_CODE,&changes->status);
+  if (changes->status != 200)
+    return realsize;
+
+  if (changes->opts->longpoll) {
+    if (!changes->parser) {
+      changes->parser = stream_parser_new();
+      stream_parser_rows(changes->parser,"results",changes_row,changes);
+    }
+    stream_parser_feed(changes->parser,buf,len);
+    return changes->stopped ? 0 : realsize;
+  }
+
+  while (len > 0) {
+    const char* newline = (const char*) memchr(buf,'\n',len);
+    size_t line_len = newline ? (size_t) (newline - buf) : len;
+    size_t i;
+    for(i = 0; i < line_len && !changes->parser; i++) {
+      if (!isspace((unsigned char) buf[i]))
+        changes->parser = stream_parser_new();
+    }
+    if (changes->parser && line_len > 0)
+      stream_parser_feed(changes->parser,buf,line_len);
+    if (newline) {
+      if (changes->parser) {
+        pt_node_t* change = stream_parser_finish(changes->parser);
+        changes->parser = NULL;
+        if (change) {
+          changes_dispatch(changes,change);
+          pt_free_node(change);
+          if (changes->stopped)
+            return 0;
+        }
+      }
+      line_len++;
+    }
+    buf += line_len;
+    len -= line_len;
+  }
+  return realsize;
+}
+
+/*
+ * A GET whose "rows" are streamed to callback rather than collected.  The
+ * raw body is never kept since it would grow with the size of the view.
+ */
+static pt_request_t* view_request_new(pt_session_impl_t* session, const char* view_target, pt_row_callback callback, void* userdata)
+{
+  pt_request_t* req = request_new(session,"GET",view_target,NULL,0,1);
+  if (!req->parser)
+    req->parser = stream_parser_new();
+  req->parser->ctx->intern_keys = session && session->intern_keys;
+  // the rows are the callback's to keep, so nothing goes in an arena
+  req->parser->ctx->arena = NULL;
+  arena_free(req->arena);
+  req->arena = NULL;
+  req->retain_raw = 0;
+  stream_parser_rows(req->parser,"rows",callback,userdata);
+  // rows already handed to the callback can't be taken back
+  request_no_replay(req);
+  return req;
+}
+
+/* Row callback for pt_view_open, buffers rows until pt_view_next asks */
+static int view_queue_row(pt_node_t* row, void* data)
+{
+  pt_view_impl_t* view = (pt_view_impl_t*) data;
+  pt_view_row_t* entry = (pt_view_row_t*) malloc(sizeof(pt_view_row_t));
+  entry->row = row;
+  DL_APPEND(view->rows,entry);
+  return 0;
+}
+
+/* Start a fresh {"docs":[ body for the next batch */
+static void bulk_writer_begin(pt_bulk_writer_impl_t* writer)
+{
+  writer->gen = new_generator(0);
+  yajl_gen_map_open(writer->gen);
+  yajl_gen_string(writer->gen,(const unsigned char*) "docs",4);
+  yajl_gen_array_open(writer->gen);
+}
+
+static yajl_gen new_generator(int beautify)
+{
+#ifdef HAVE_YAJL_V2
+  yajl_gen g = yajl_gen_alloc(NULL);
+  yajl_gen_config(g, yajl_gen_beautify, beautify);
+  yajl_gen_config(g, yajl_gen_indent_string, "  ");
+#else
+  yajl_gen_config conf = { beautify,"  "};
+  yajl_gen g = yajl_gen_alloc(&conf, NULL);
+#endif
+  return g;
+}
+
+static void sleep_ms(long ms)
+{
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (ms % 1000) * 1000000;
+  nanosleep(&ts,NULL);
+}
+
+/* Percent encode everything but the unreserved characters of RFC 3986 */
+static char* url_escape(const char* str)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  char* escaped = (char*) malloc(strlen(str) * 3 + 1);
+  char* out = escaped;
+  for(; *str; str++) {
+    unsigned char c = (unsigned char) *str;
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      *out++ = c;
+    } else {
+      *out++ = '%';
+      *out++ = hex[c >> 4];
+      *out++ = hex[c & 0xf];
+    }
+  }
+  *out = '\0';
+  return escaped;
+}
+
+/* Current time in milliseconds from a clock that never jumps backwards */
+static long long monotonic_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Format a message and hand it to the sink, without the trailing newline */
+static void log_write(pt_log_level_t level, const char* format, ...)
+{
+  char message[1024];
+  va_list args;
+  va_start(args,format);
+  vsnprintf(message,sizeof(message),format,args);
+  va_end(args);
+
+  size_t len = strlen(message);
+  while (len > 0 && message[len - 1] == '\n')
+    message[--len] = '\0';
+
+  pt_log_callback sink = log_sink;
+  if (sink)
+    sink(level,message,log_userdata);
+  else
+    fprintf(stderr,"pillowtalk: %s\n",message);
+}
+
+static unsigned long long monotonic_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The start time for metrics_stop, or 0 when metrics are off */
+static unsigned long long metrics_start()
+{
+  if (!__atomic_load_n(&metrics_enabled,__ATOMIC_RELAXED))
+    return 0;
+  return monotonic_us();
+}
+
+static void metrics_stop(pt_metric_t metric, unsigned long long start)
+{
+  if (start)
+    metrics_record(metric,monotonic_us() - start);
+}
+
+/*
+ * Only this thread writes to its shard, so a plain read-modify-write is safe.
+ * The stores are atomic only so a concurrent snapshot never sees a torn value.
+ */
+#define METRIC_SET(field,value) __atomic_store_n(&(field),(value),__ATOMIC_RELAXED)
+
+static void metrics_record(pt_metric_t metric, unsigned long long us)
+{
+  pt_histogram_t* histogram = &metrics_local_shard()->histograms[metric];
+  unsigned int bucket = histogram_bucket(us);
+  METRIC_SET(histogram->buckets[bucket],histogram->buckets[bucket] + 1);
+  if (!histogram->count || us < histogram->min_us)
+    METRIC_SET(histogram->min_us,us);
+  if (us > histogram->max_us)
+    METRIC_SET(histogram->max_us,us);
+  METRIC_SET(histogram->total_us,histogram->total_us + us);
+  METRIC_SET(histogram->count,histogram->count + 1);
+}
+
+static void metrics_count(pt_counter_t counter, unsigned long long n)
+{
+  if (!__atomic_load_n(&metrics_enabled,__ATOMIC_RELAXED))
+    return;
+  pt_metrics_shard_t* shard = metrics_local_shard();
+  METRIC_SET(shard->counters[counter],shard->counters[counter] + n);
+}
+
+/*
+ * This thread's shard.  The first time a thread records anything it takes
+ * over a shard abandoned by an exited thread, or pushes a new one onto the
+ * list.  Both are lock free.
+ */
+static pt_metrics_shard_t* metrics_local_shard()
+{
+  pt_metrics_shard_t* shard = metrics_shard;
+  if (shard)
+    return shard;
+
+  pthread_once(&metrics_key_once,metrics_make_key);
+  for(shard = __atomic_load_n(&metrics_shards,__ATOMIC_ACQUIRE); shard; shard = shard->next) {
+    int unused = 0;
+    if (__atomic_compare_exchange_n(&shard->in_use,&unused,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+      break;
+  }
+  if (!shard) {
+    shard = (pt_metrics_shard_t*) calloc(1,sizeof(pt_metrics_shard_t));
+    shard->in_use = 1;
+    shard->next = __atomic_load_n(&metrics_shards,__ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_shards,&shard->next,shard,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+      ;
+  }
+  metrics_shard = shard;
+  pthread_setspecific(metrics_key,shard);
+  return shard;
+}
+
+static void metrics_make_key()
+{
+  pthread_key_create(&metrics_key,metrics_thread_exit);
+}
+
+/* Hand the exiting thread's shard, counts and all, to the next thread */
+static void metrics_thread_exit(void* shard)
+{
+  __atomic_store_n(&((pt_metrics_shard_t*) shard)->in_use,0,__ATOMIC_RELEASE);
+}
+
+/*
+ * Values below 16 get a bucket each.  Above that the bucket is picked by the
+ * position of the top bit plus the 4 bits below it, so each power of two is
+ * split into 16 equal buckets.
+ */
+static unsigned int histogram_bucket(unsigned long long us)
+{
+  if (us < 16)
+    return (unsigned int) us;
+  unsigned int top = 63 - __builtin_clzll(us);
+  if (top > 40)
+    return PT_HISTOGRAM_BUCKETS - 1;
+  return (top - 4) * 16 + (unsigned int) (us >> (top - 4));
+}
+
+/* The largest value that falls in bucket */
+static unsigned long long histogram_bucket_value(unsigned int bucket)
+{
+  if (bucket < 32)
+    return bucket;
+  unsigned int shift = bucket / 16 - 1;
+  unsigned long long mantissa = bucket % 16 + 16;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+static double monotonic_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Fill in where the time and bytes for a finished request went */
+static void request_timing(pt_request_t* req, pt_timing_t* timing)
+{
+  CURL* curl = req->handle->curl;
+  curl_off_t body_sent = 0, body_received = 0;
+  long headers_sent = 0, headers_received = 0;
+
+  curl_easy_getinfo(curl,CURLINFO_NAMELOOKUP_TIME,&timing->namelookup);
+  curl_easy_getinfo(curl,CURLINFO_CONNECT_TIME,&timing->connect);
+  curl_easy_getinfo(curl,CURLINFO_PRETRANSFER_TIME,&timing->pretransfer);
+  curl_easy_getinfo(curl,CURLINFO_STARTTRANSFER_TIME,&timing->starttransfer);
+  curl_easy_getinfo(curl,CURLINFO_TOTAL_TIME,&timing->total);
+  curl_easy_getinfo(curl,CURLINFO_SIZE_UPLOAD_T,&body_sent);
+  curl_easy_getinfo(curl,CURLINFO_SIZE_DOWNLOAD_T,&body_received);
+  curl_easy_getinfo(curl,CURLINFO_REQUEST_SIZE,&headers_sent);
+  curl_easy_getinfo(curl,CURLINFO_HEADER_SIZE,&headers_received);
+  timing->bytes_sent = headers_sent + body_sent;
+  timing->bytes_received = headers_received + body_received;
+  timing->parse = req->parse_time;
+  timing->serialize = req->serialize_time;
+}
+
+/*
+ * Append a path component like "_all_docs" to a database url
+ */
+static char* build_url(const char* base, const char* path)
+{
+  size_t base_len = strlen(base);
+  size_t path_len = strlen(path);
+  char* url = (char*) malloc(base_len + path_len + 2);
+  memcpy(url,base,base_len);
+  if (base_len == 0 || base[base_len - 1] != '/')
+    url[base_len++] = '/';
+  memcpy(url + base_len,path,path_len + 1);
+  return url;
+}
+
+/*
+ * Length of the scheme://authority part of a url, which is what keep-alive
+ * connections are keyed on
+ */
+static size_t host_key_len(const char* server_target)
+{
+  const char* start = strstr(server_target,"://");
+  start = start ? start + 3 : server_target;
+  return strcspn(start,"/?#") + (start - server_target);
+}
+
+/*
+ * Find an idle handle that last talked to the same host so its connection
+ * gets reused, otherwise make a new one
+ */
+static pt_pooled_handle_t* acquire_handle(pt_session_impl_t* session, const char* server_target)
+{
+  pt_pooled_handle_t* handle = NULL;
+  size_t len = host_key_len(server_target);
+  if (session) {
+    /*
+     * Prefer a handle this thread used last, its memory is likely still in
+     * this core's cache; any handle for the host will do otherwise.
+     */
+    pthread_t self = pthread_self();
+    pt_pooled_handle_t* found = NULL;
+    pthread_mutex_lock(&session->lock);
+    DL_FOREACH(session->idle,handle) {
+      if (handle->host_len == len && !strncmp(handle->host,server_target,len)) {
+        if (!found)
+          found = handle;
+        if (pthread_equal(handle->owner,self)) {
+          found = handle;
+          break;
+        }
+      }
+    }
+    if (found) {
+      DL_DELETE(session->idle,found);
+      session->idle_count--;
+    }
+    pthread_mutex_unlock(&session->lock);
+    if (found)
+      return found;
+  }
+  handle = (pt_pooled_handle_t*) calloc(1,sizeof(pt_pooled_handle_t));
+  handle->curl = curl_easy_init();
+  handle->host = (char*) malloc(len + 1);
+  memcpy(handle->host,server_target,len);
+  handle->host[len] = '\0';
+  handle->host_len = len;
+  return handle;
+}
 
-  /* specify URL to get */
-  curl_easy_setopt(curl_handle, CURLOPT_URL, server_target);
+/*
+ * Park a handle in the session for the next request to its host.  Resetting
+ * the options keeps the live connection, so only the least recently used
+ * handle gets closed when the pool is full.
+ */
+static void release_handle(pt_session_impl_t* session, pt_pooled_handle_t* handle)
+{
+  if (!session || session->max_pool_size == 0) {
+    free_pooled_handle(handle);
+    return;
+  }
 
-  curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT, 10);
+  curl_easy_reset(handle->curl);
+  handle->owner = pthread_self();
 
-  // Want to avoid CURL SIGNALS
-  curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1);
+  pt_pooled_handle_t* oldest = NULL;
+  pthread_mutex_lock(&session->lock);
+  if (session->idle_count >= session->max_pool_size) {
+    oldest = session->idle->prev;
+    DL_DELETE(session->idle,oldest);
+    session->idle_count--;
+  }
+  DL_PREPEND(session->idle,handle);
+  session->idle_count++;
+  pthread_mutex_unlock(&session->lock);
 
-  printf("%s : %s\n",http_method,server_target);
+  if (oldest)
+    free_pooled_handle(oldest);
+}
 
-  if (!strcmp("PUT",http_method))
-    curl_easy_setopt(curl_handle, CURLOPT_UPLOAD, 1);
-  else
-    curl_easy_setopt(curl_handle, CURLOPT_CUSTOMREQUEST, http_method);
+static void share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+  pthread_mutex_lock(&((pt_session_impl_t*) userptr)->share_locks[data]);
+}
 
-  if (data && data_len > 0) {
-    send_chunk.memory = (char*) malloc(data_len);
-    memcpy(send_chunk.memory,data,data_len);
-    send_chunk.offset = send_chunk.memory;
-    send_chunk.size = data_len;
-    curl_easy_setopt(curl_handle, CURLOPT_READFUNCTION, send_memory_callback);
-    curl_easy_setopt(curl_handle, CURLOPT_READDATA, (void*) &send_chunk);
-  }
+static void share_unlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+  pthread_mutex_unlock(&((pt_session_impl_t*) userptr)->share_locks[data]);
+}
 
-  /* send all data to this function  */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, recv_memory_callback);
+static void free_pooled_handle(pt_pooled_handle_t* handle)
+{
+  if (handle->multi)
+    curl_multi_cleanup(handle->multi);
+  curl_easy_cleanup(handle->curl);
+  free(handle->host);
+  free(handle);
+}
 
-  /* we pass our 'chunk' struct to the callback function */
-  curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&recv_chunk);
+/*
+ * Make room for needed bytes in the receive buffer.  The first buffer comes
+ * from the session's pool when it has one, and after that capacity doubles so
+ * a big body costs a handful of reallocs instead of one per chunk.  exact
+ * asks for precisely needed bytes, for when the Content-Length is known.
+ */
+static int recv_chunk_reserve(pt_request_t* req, size_t needed, int exact)
+{
+  struct memory_chunk *mem = &req->recv_chunk;
+  if (needed <= mem->capacity)
+    return 1;
 
-  /* some servers don't like requests that are made without a user-agent
-     field, so we provide one */
-  curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "pillowtalk-agent/0.1");
+  if (!mem->memory && req->pool && buffer_pool_take(req->pool,mem)) {
+    if (needed <= mem->capacity)
+      return 1;
+  }
 
-  /* get it! */
-  ret = curl_easy_perform(curl_handle);
+  size_t capacity = needed;
+  if (!exact) {
+    capacity = mem->capacity ? mem->capacity : PT_RECV_MIN_CAPACITY;
+    while (capacity < needed)
+      capacity *= 2;
+  }
+  char* memory = (char*) realloc(mem->memory,capacity);
+  if (!memory)
+    return 0;
+  mem->memory = memory;
+  mem->capacity = capacity;
+  return 1;
+}
 
-  pt_response_t* res = calloc(1,sizeof(pt_response_t));
-  if ((!ret)) {
-    ret = curl_easy_getinfo(curl_handle,CURLINFO_RESPONSE_CODE, &res->response_code);
-    if (ret != CURLE_OK)
-      res->response_code = 500;
+static pt_buffer_pool_t* buffer_pool_new()
+{
+  pt_buffer_pool_t* pool = (pt_buffer_pool_t*) calloc(1,sizeof(pt_buffer_pool_t));
+  pthread_mutex_init(&pool->lock,NULL);
+  pool->refcount = 1;
+  return pool;
+}
 
-    if (recv_chunk.size > 0) {
-      // Parse the JSON chunk returned
-      recv_chunk.memory[recv_chunk.size] = '\0';
-      res->raw_json = recv_chunk.memory;
-      res->raw_json_len = recv_chunk.size;
-    }
+/* Move a spare buffer into mem, returns 0 if there isn't one */
+static int buffer_pool_take(pt_buffer_pool_t* pool, struct memory_chunk* mem)
+{
+  int taken = 0;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count) {
+    pt_pooled_buffer_t* spare = &pool->buffers[--pool->count];
+    mem->memory = spare->memory;
+    mem->capacity = spare->capacity;
+    taken = 1;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return taken;
+}
+
+/* Change how many spare buffers the pool keeps, freeing any extras */
+static void buffer_pool_resize(pt_buffer_pool_t* pool, unsigned int max_buffers)
+{
+  pthread_mutex_lock(&pool->lock);
+  while (pool->count > max_buffers)
+    free(pool->buffers[--pool->count].memory);
+  if (max_buffers) {
+    pool->buffers = (pt_pooled_buffer_t*) realloc(pool->buffers,max_buffers * sizeof(pt_pooled_buffer_t));
   } else {
-    res->response_code = 500;
+    free(pool->buffers);
+    pool->buffers = NULL;
   }
+  pool->max_buffers = max_buffers;
+  pthread_mutex_unlock(&pool->lock);
+}
 
-  if (send_chunk.memory)
-    free(send_chunk.memory);
+/* Keep a finished buffer for the next request, or free it if the pool is full */
+static void buffer_pool_put(pt_buffer_pool_t* pool, char* memory, size_t capacity)
+{
+  if (!memory)
+    return;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->count < pool->max_buffers && capacity <= PT_POOLED_BUFFER_MAX) {
+    pool->buffers[pool->count].memory = memory;
+    pool->buffers[pool->count].capacity = capacity;
+    pool->count++;
+    memory = NULL;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  free(memory);
+}
 
-  /* cleanup curl stuff */
-  curl_easy_cleanup(curl_handle);
-  return res;
+static void buffer_pool_retain(pt_buffer_pool_t* pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->refcount++;
+  pthread_mutex_unlock(&pool->lock);
 }
 
-static void *myrealloc(void *ptr, size_t size)
+static void buffer_pool_release(pt_buffer_pool_t* pool)
 {
-  /* There might be a realloc() out there that doesn't like reallocing
-     NULL pointers, so we take care of it here */
-  if(ptr)
-    return (void*) realloc(ptr, size);
-  else
-    return (void*) malloc(size);
+  pthread_mutex_lock(&pool->lock);
+  unsigned int refcount = --pool->refcount;
+  pthread_mutex_unlock(&pool->lock);
+  if (refcount == 0) {
+    buffer_pool_resize(pool,0);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+  }
 }
 
+/*
+ * Body bytes go straight into the json parser when the request streams,
+ * and into the raw buffer unless the session asked not to keep it
+ */
 static size_t recv_memory_callback(void *ptr, size_t size, size_t nmemb, void *data)
 {
   size_t realsize = size * nmemb;
-  struct memory_chunk *mem = (struct memory_chunk*)data;
+  pt_request_t* req = (pt_request_t*) data;
+  struct memory_chunk *mem = &req->recv_chunk;
+
+  if (req->parser) {
+    double start = monotonic_seconds();
+    int failed = stream_parser_feed(req->parser,(const char*) ptr,realsize);
+    req->parse_time += monotonic_seconds() - start;
+    if (failed && req->parser->ctx->stopped)
+      return 0;
+  }
 
-  mem->memory = (char*) myrealloc(mem->memory, mem->size + realsize + 1);
-  if (mem->memory) {
+  if (req->retain_raw) {
+    // size the buffer for the whole body up front when the server told us
+    if (!mem->capacity) {
+      curl_off_t length = -1;
+      curl_easy_getinfo(req->handle->curl,CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,&length);
+      if (length > 0 && !recv_chunk_reserve(req,(size_t) length + 1,1))
+        return 0;
+    }
+    if (!recv_chunk_reserve(req,mem->size + realsize + 1,0))
+      return 0;
     memcpy(&(mem->memory[mem->size]), ptr, realsize);
     mem->size += realsize;
     mem->memory[mem->size] = 0;
@@ -626,6 +3069,79 @@ static size_t recv_memory_callback(void *ptr, size_t size, size_t nmemb, void *d
   return realsize;
 }
 
+/* Catches the ETag of a response that might go in the cache */
+static size_t recv_header_callback(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t realsize = size * nmemb;
+  pt_request_t* req = (pt_request_t*) data;
+  const char* header = (const char*) ptr;
+  if (realsize > 5 && !strncasecmp(header,"ETag:",5)) {
+    size_t start = 5, end = realsize;
+    while (start < end && isspace((unsigned char) header[start]))
+      start++;
+    while (end > start && isspace((unsigned char) header[end - 1]))
+      end--;
+    free(req->etag);
+    req->etag = strndup(header + start,end - start);
+  }
+  return realsize;
+}
+
+/*
+ * Writes a successful attachment download to the request's fd.  An error
+ * status comes with a json body, which is kept for the response instead.
+ */
+static size_t recv_fd_callback(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t realsize = size * nmemb;
+  pt_request_t* req = (pt_request_t*) data;
+  const char* buf = (const char*) ptr;
+  size_t left = realsize;
+  long code = 0;
+  curl_easy_getinfo(req->handle->curl,CURLINFO_RESPONSE_CODE,&code);
+  if (code < 200 || code >= 300)
+    return recv_memory_callback(ptr,size,nmemb,data);
+
+  while (left > 0) {
+    ssize_t written = write(req->fd,buf,left);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      PT_LOG(PT_LOG_WARN,"writing attachment: %s",strerror(errno));
+      return 0;
+    }
+    buf += written;
+    left -= written;
+  }
+  return realsize;
+}
+
+/* Reads an attachment upload from the request's fd, a buffer at a time */
+static size_t send_fd_callback(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  pt_request_t* req = (pt_request_t*) data;
+  for(;;) {
+    ssize_t got = read(req->fd,ptr,size * nmemb);
+    if (got >= 0)
+      return (size_t) got;
+    if (errno != EINTR) {
+      PT_LOG(PT_LOG_WARN,"reading attachment: %s",strerror(errno));
+      return CURL_READFUNC_ABORT;
+    }
+  }
+}
+
+/* Puts the fd back where the upload started; pipes and sockets can't go back */
+static int send_fd_seek(void *data, curl_off_t offset, int origin)
+{
+  pt_request_t* req = (pt_request_t*) data;
+  if (origin != SEEK_SET || offset != 0 || req->fd_start < 0)
+    return CURL_SEEKFUNC_CANTSEEK;
+  if (lseek(req->fd,req->fd_start,SEEK_SET) < 0)
+    return CURL_SEEKFUNC_FAIL;
+  return CURL_SEEKFUNC_OK;
+}
+
 static size_t send_memory_callback(void *ptr, size_t size, size_t nmemb, void *data)
 {
   size_t realsize = size * nmemb;
@@ -643,22 +3159,86 @@ static size_t send_memory_callback(void *ptr, size_t size, size_t nmemb, void *d
   return 0;
 }
 
+/* Start the body over, which is all curl asks of us before resending it */
+static int send_memory_seek(void *data, curl_off_t offset, int origin)
+{
+  pt_request_t* req = (pt_request_t*) data;
+  if (origin != SEEK_SET || offset != 0)
+    return CURL_SEEKFUNC_CANTSEEK;
+  req->send_chunk.offset = (char*) req->send_start;
+  req->send_chunk.size = req->send_len;
+  return CURL_SEEKFUNC_OK;
+}
+
+/*
+ * Set up a gzip stream that reads the body straight out of data.  Returns 0
+ * if zlib couldn't be initialized, in which case the body is sent as is.
+ */
+static int request_gzip_body(pt_request_t* req, const char* data, unsigned data_len)
+{
+  z_stream* z = (z_stream*) calloc(1,sizeof(z_stream));
+  // 16 + MAX_WBITS asks for a gzip header rather than a raw zlib one
+  if (deflateInit2(z,Z_BEST_SPEED,Z_DEFLATED,16 + MAX_WBITS,8,Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(z);
+    return 0;
+  }
+  z->next_in = (Bytef*) data;
+  z->avail_in = data_len;
+  req->gzip = z;
+  req->send_start = data;
+  req->send_len = data_len;
+  return 1;
+}
+
+/*
+ * Throw away whatever has been compressed and start the stream over, so a
+ * resend is byte for byte the same as the first try
+ */
+static int send_gzip_seek(void *data, curl_off_t offset, int origin)
+{
+  pt_request_t* req = (pt_request_t*) data;
+  if (origin != SEEK_SET || offset != 0 || !req->gzip || deflateReset(req->gzip) != Z_OK)
+    return CURL_SEEKFUNC_CANTSEEK;
+  req->gzip->next_in = (Bytef*) req->send_start;
+  req->gzip->avail_in = req->send_len;
+  return CURL_SEEKFUNC_OK;
+}
+
+/*
+ * Compress the next piece of the body directly into curl's upload buffer, so
+ * the whole compressed body never exists in memory at once.  The stream is
+ * kept once it has ended, in case curl has to rewind it; deflate just has
+ * nothing more to give until then.
+ */
+static size_t send_gzip_callback(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  pt_request_t* req = (pt_request_t*) data;
+  size_t realsize = size * nmemb;
+  if (!req->gzip || realsize < 1)
+    return 0;
+
+  req->gzip->next_out = (Bytef*) ptr;
+  req->gzip->avail_out = realsize;
+  int ret = deflate(req->gzip,Z_FINISH);
+  if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+    return CURL_READFUNC_ABORT;
+  return realsize - req->gzip->avail_out;
+}
+
 /* Yajl Callbacks */
 static int json_null(void* ctx)
 {
-  pt_node_t* node = (pt_node_t*) malloc(sizeof(pt_node_t));
+  pt_node_t* node = (pt_node_t*) node_alloc((pt_parser_ctx_t*) ctx,sizeof(pt_null_value_t));
   node->type = PT_NULL;
-  add_node_to_context_container((pt_parser_ctx_t*) ctx,node);
-  return 1;
+  return add_node_to_context_container((pt_parser_ctx_t*) ctx,node);
 }
 
 static int json_boolean(void* ctx,int boolean)
 {
-  pt_bool_value_t * node = (pt_bool_value_t*) calloc(1,sizeof(pt_bool_value_t));
+  pt_bool_value_t * node = (pt_bool_value_t*) node_alloc((pt_parser_ctx_t*) ctx,sizeof(pt_bool_value_t));
   node->parent.type = PT_BOOLEAN;
   node->value = boolean;
-  add_node_to_context_container((pt_parser_ctx_t*) ctx,(pt_node_t*)node);
-  return 1;
+  return add_node_to_context_container((pt_parser_ctx_t*) ctx,(pt_node_t*)node);
 }
 
 #ifdef HAVE_YAJL_V2
@@ -670,13 +3250,21 @@ static int json_map_key(void* ctx, const unsigned char* str, unsigned int length
   pt_parser_ctx_t* parser_ctx= (pt_parser_ctx_t*) ctx;
   assert(parser_ctx->stack && parser_ctx->stack->container->type == PT_MAP);
   pt_map_t* container = (pt_map_t*) parser_ctx->stack->container;
-  pt_key_value_t* new_node = (pt_key_value_t*) calloc(1,sizeof(pt_key_value_t));
-  char* new_str = (char*) malloc(length + 1);
-  memcpy(new_str,str,length);
-  new_str[length] = 0x0;
-  new_node->key = new_str;
+  pt_key_value_t* new_node = (pt_key_value_t*) node_alloc(parser_ctx,sizeof(pt_key_value_t));
+  pt_interned_key_t* interned = NULL;
+  if (parser_ctx->intern_keys)
+    interned = key_intern((const char*) str,length,key_hash((const char*) str,length),PT_INTERN_PARSED_KEYS);
   new_node->parent.type = PT_KEY_VALUE;
-  HASH_ADD_KEYPTR(hh,container->key_values,new_node->key,length,new_node);
+  hash_arena = parser_ctx->arena;
+  if (interned) {
+    new_node->key = interned->str;
+    new_node->parent.flags |= PT_NODE_INTERNED;
+    HASH_ADD_KEYPTR_BYHASHVALUE(hh,container->key_values,new_node->key,length,interned->hashv,new_node);
+  } else {
+    new_node->key = string_alloc(parser_ctx,(pt_node_t*) new_node,str,length);
+    HASH_ADD_KEYPTR(hh,container->key_values,new_node->key,length,new_node);
+  }
+  hash_arena = NULL;
   parser_ctx->stack->cur = (pt_node_t*) new_node;
   return 1;
 }
@@ -687,22 +3275,22 @@ static int json_integer(void* ctx,long long integer)
 static int json_integer(void* ctx,long integer)
 #endif
 {
-  pt_int_value_t* node = (pt_int_value_t*) calloc(1,sizeof(pt_int_value_t));
+  pt_int_value_t* node = (pt_int_value_t*) node_alloc((pt_parser_ctx_t*) ctx,sizeof(pt_int_value_t));
   node->parent.type = PT_INTEGER;
   node->value = integer;
+  if (node->value != integer)
+    node->parent.flags |= PT_NODE_TRUNCATED;
 
-  add_node_to_context_container(ctx,(pt_node_t*) node);
-  return 1;
+  return add_node_to_context_container(ctx,(pt_node_t*) node);
 }
 
 static int json_double(void* ctx,double dbl)
 {
-  pt_double_value_t* node = (pt_double_value_t*) calloc(1,sizeof(pt_double_value_t));
+  pt_double_value_t* node = (pt_double_value_t*) node_alloc((pt_parser_ctx_t*) ctx,sizeof(pt_double_value_t));
   node->parent.type = PT_DOUBLE;
   node->value = dbl;
 
-  add_node_to_context_container(ctx,(pt_node_t*) node);
-  return 1;
+  return add_node_to_context_container(ctx,(pt_node_t*) node);
 }
 
 #ifdef HAVE_YAJL_V2
@@ -711,14 +3299,11 @@ static int json_string(void* ctx, const unsigned char* str, size_t length)
 static int json_string(void* ctx, const unsigned char* str, unsigned int length)
 #endif
 {
-  char* new_str = (char*) malloc(length + 1);
-  memcpy(new_str,str,length);
-  new_str[length] = 0x0;
-  pt_str_value_t* node = (pt_str_value_t*) calloc(1,sizeof(pt_str_value_t));
+  pt_parser_ctx_t* parser_ctx = (pt_parser_ctx_t*) ctx;
+  pt_str_value_t* node = (pt_str_value_t*) node_alloc(parser_ctx,sizeof(pt_str_value_t));
   node->parent.type = PT_STRING;
-  node->value = new_str;
-  add_node_to_context_container(ctx,(pt_node_t*) node);
-  return 1;
+  node->value = string_alloc(parser_ctx,(pt_node_t*) node,str,length);
+  return add_node_to_context_container(ctx,(pt_node_t*) node);
 }
 
 /* If we aren't in a key value pair then we create a new node, otherwise we are
@@ -727,12 +3312,10 @@ static int json_string(void* ctx, const unsigned char* str, unsigned int length)
 static int json_start_map(void* ctx)
 {
   pt_parser_ctx_t* parser_ctx = (pt_parser_ctx_t*) ctx;
-  pt_node_t* new_node = (pt_node_t*) calloc(1,sizeof(pt_map_t));
+  pt_node_t* new_node = (pt_node_t*) node_alloc(parser_ctx,sizeof(pt_map_t));
   new_node->type = PT_MAP;
   add_node_to_context_container(parser_ctx,new_node);
-  pt_container_ctx_t* new_ctx = (pt_container_ctx_t*) calloc(1,sizeof(pt_container_ctx_t));
-  new_ctx->container = new_node;
-  LL_PREPEND(parser_ctx->stack,new_ctx);
+  push_container(parser_ctx,new_node);
   return 1;
 }
 
@@ -741,9 +3324,11 @@ static int json_end_map(void* ctx)
   pt_parser_ctx_t* parser_ctx = (pt_parser_ctx_t*) ctx;
   assert(parser_ctx->stack->container->type == PT_MAP);
   if (parser_ctx->stack) {
-    pt_container_ctx_t* old_head = parser_ctx->stack;
-    LL_DELETE(parser_ctx->stack,old_head);
-    free(old_head);
+    pt_node_t* done = pop_container(parser_ctx);
+    if (done == parser_ctx->stream_row) {
+      parser_ctx->stream_row = NULL;
+      return emit_stream_row(parser_ctx,done);
+    }
   }
   return 1;
 }
@@ -751,14 +3336,19 @@ static int json_end_map(void* ctx)
 static int json_start_array(void* ctx)
 {
   pt_parser_ctx_t* parser_ctx = (pt_parser_ctx_t*) ctx;
-  pt_array_t* new_node = (pt_array_t*) calloc(1,sizeof(pt_array_t));
+  /* is this the top level array whose elements get streamed out? */
+  int streamed = parser_ctx->stream_key && !parser_ctx->stream_array &&
+    parser_ctx->stack && !parser_ctx->stack->next &&
+    parser_ctx->stack->cur && parser_ctx->stack->cur->type == PT_KEY_VALUE &&
+    !strcmp(((pt_key_value_t*) parser_ctx->stack->cur)->key,parser_ctx->stream_key);
+  pt_array_t* new_node = (pt_array_t*) node_alloc(parser_ctx,sizeof(pt_array_t));
   TAILQ_INIT(&new_node->head);
   new_node->parent.type = PT_ARRAY;
   add_node_to_context_container(parser_ctx,(pt_node_t*) new_node);
-  pt_container_ctx_t* new_ctx = (pt_container_ctx_t*) calloc(1,sizeof(pt_container_ctx_t));
-  new_ctx->container = (pt_node_t*) new_node;
-  new_ctx->cur = (pt_node_t*) new_node;
-  LL_PREPEND(parser_ctx->stack,new_ctx);
+  push_container(parser_ctx,(pt_node_t*) new_node);
+  parser_ctx->stack->cur = (pt_node_t*) new_node;
+  if (streamed)
+    parser_ctx->stream_array = (pt_node_t*) new_node;
   return 1;
 }
 
@@ -767,25 +3357,48 @@ static int json_end_array(void* ctx)
   pt_parser_ctx_t* parser_ctx = (pt_parser_ctx_t*) ctx;
   assert(parser_ctx->stack->container->type == PT_ARRAY);
   if (parser_ctx->stack) {
-    pt_container_ctx_t* old_head = parser_ctx->stack;
-    LL_DELETE(parser_ctx->stack,old_head);
-    free(old_head);
+    pt_node_t* done = pop_container(parser_ctx);
+    if (done == parser_ctx->stream_row) {
+      parser_ctx->stream_row = NULL;
+      return emit_stream_row(parser_ctx,done);
+    }
   }
   return 1;
 }
 
+/*
+ * Give a finished element of the streamed array to the row callback, which
+ * takes ownership of it.  Returns 0 to make yajl stop if the callback asked
+ * to.
+ */
+static int emit_stream_row(pt_parser_ctx_t* context, pt_node_t* row)
+{
+  int stop = context->row_callback(row,context->row_userdata);
+  if (stop)
+    context->stopped = 1;
+  return !stop;
+}
+
 /*
  * This function looks to see what the current node and adds the new value node to it.
  * If it is an array it appends the value to the array.
  * If it is a key value pair it adds it to the value field of that pair.
+ * Elements of a streamed array are held back until they are complete and
+ * then handed to the row callback instead.
  */
-static void add_node_to_context_container(pt_parser_ctx_t* context, pt_node_t* value)
+static int add_node_to_context_container(pt_parser_ctx_t* context, pt_node_t* value)
 {
   if (context->stack && context->stack->cur) {
     pt_node_t* cur = context->stack->cur;
-    if (cur->type == PT_ARRAY) {
+    if (cur == context->stream_array) {
+      if (value->type == PT_MAP || value->type == PT_ARRAY)
+        context->stream_row = value;
+      else
+        return emit_stream_row(context,value);
+    } else if (cur->type == PT_ARRAY) {
       pt_array_t* resolved = (pt_array_t*) cur;
-      pt_array_elem_t* elem = (pt_array_elem_t*) malloc(sizeof(pt_array_elem_t));
+      pt_array_elem_t* elem = (pt_array_elem_t*) (context->arena ?
+          arena_alloc(context->arena,sizeof(pt_array_elem_t)) : slab_alloc(sizeof(pt_array_elem_t)));
       elem->node = value;
       TAILQ_INSERT_TAIL(&resolved->head,elem,entries);
       resolved->len++;
@@ -793,47 +3406,407 @@ static void add_node_to_context_container(pt_parser_ctx_t* context, pt_node_t* v
       pt_key_value_t* resolved = (pt_key_value_t*) cur;
       resolved->value = value;
     } else {
-      printf("Shouldn't get here: %d:%d\n", cur->type, value->type);
+      PT_LOG(PT_LOG_ERROR,"can't add a node of type %d to one of type %d",value->type,cur->type);
     }
   } else {
     context->root = value;
   }
+  return 1;
 }
 
-static pt_node_t* parse_json(const char* json, int json_len)
+/*
+ * Parse a whole document, into arena if there is one, or onto the heap.
+ * With in_situ the tree's strings are left in json, which gets written to,
+ * and with intern_keys its map keys are the interned ones.
+ */
+static pt_node_t* parse_json(const char* json, int json_len, pt_arena_t* arena, int in_situ, int intern_keys)
+{
+  unsigned long long start = metrics_start();
+  pt_stream_parser_t* parser = stream_parser_new();
+  parser->ctx->arena = arena;
+  parser->ctx->intern_keys = intern_keys;
+  if (in_situ) {
+    parser->ctx->in_situ = (char*) json;
+    parser->ctx->in_situ_len = json_len;
+    parser->ctx->hand = parser->hand;
+  }
+  if (json && json_len > 0)
+    stream_parser_feed(parser,json,json_len);
+  pt_node_t* root = stream_parser_finish(parser);
+  metrics_stop(PT_METRIC_PARSE,start);
+  return root;
+}
+
+/* A zeroed node for the parser to fill in */
+static void* node_alloc(pt_parser_ctx_t* context, size_t size)
+{
+  pt_node_t* node;
+  if (!context->arena)
+    return slab_alloc(size);
+  node = (pt_node_t*) arena_alloc(context->arena,size);
+  memset(node,0,size);
+  node->flags = PT_NODE_ARENA;
+  return node;
+}
+
+/*
+ * A NUL terminated copy of a string or key yajl handed us, for node.  In
+ * situ, a string yajl pointed at in the body is terminated where its
+ * closing quote was.  One yajl had to unescape is written back over its
+ * escaped form, which is never shorter, and ends at the same quote.
+ */
+static char* string_alloc(pt_parser_ctx_t* context, pt_node_t* node, const unsigned char* str, size_t length)
+{
+  if (context->in_situ) {
+    char* body = context->in_situ;
+    char* end = (char*) str + length;
+    if ((char*) str < body || end >= body + context->in_situ_len) {
+#ifdef HAVE_YAJL_V2
+      end = body + yajl_get_bytes_consumed(context->hand) - 1;
+#else
+      end = NULL;
+#endif
+    }
+    if (end && end >= body + length && end < body + context->in_situ_len && *end == '"') {
+      memmove(end - length,str,length);
+      *end = 0x0;
+      node->flags |= PT_NODE_IN_SITU;
+      return end - length;
+    }
+  }
+
+  char* copy = (char*) (context->arena ? arena_alloc(context->arena,length + 1) : malloc(length + 1));
+  memcpy(copy,str,length);
+  copy[length] = 0x0;
+  return copy;
+}
+
+/* Containers nest at most a few deep, so their stack entries are recycled */
+static void push_container(pt_parser_ctx_t* context, pt_node_t* container)
+{
+  pt_container_ctx_t* new_ctx = context->spare;
+  if (new_ctx)
+    LL_DELETE(context->spare,new_ctx);
+  else
+    new_ctx = (pt_container_ctx_t*) malloc(sizeof(pt_container_ctx_t));
+  new_ctx->container = container;
+  new_ctx->cur = NULL;
+  LL_PREPEND(context->stack,new_ctx);
+}
+
+static pt_node_t* pop_container(pt_parser_ctx_t* context)
+{
+  pt_container_ctx_t* old_head = context->stack;
+  LL_DELETE(context->stack,old_head);
+  LL_PREPEND(context->spare,old_head);
+  return old_head->container;
+}
+
+/* A zeroed node or array element */
+static void* slab_alloc(size_t size)
+{
+#ifdef PT_NO_SLABS
+  return calloc(1,size);
+#else
+  unsigned int size_class = (size - 1) / PT_SLAB_CLASS_BYTES;
+  size_t slot_size = (size_class + 1) * PT_SLAB_CLASS_BYTES;
+  pt_slab_cache_t* cache = slab_local_cache();
+  pt_slab_slot_t* slot;
+  assert(size_class < PT_SLAB_CLASSES);
+
+  if (!cache->free[size_class])
+    cache->free[size_class] = __atomic_exchange_n(&cache->remote[size_class],NULL,__ATOMIC_ACQUIRE);
+  slot = cache->free[size_class];
+  if (slot) {
+    cache->free[size_class] = slot->next;
+  } else {
+    if (cache->carve[size_class] + slot_size > cache->carve_end[size_class]) {
+      pt_slab_t* slab = NULL;
+      if (posix_memalign((void**) &slab,PT_SLAB_SIZE,PT_SLAB_SIZE))
+        return NULL;
+      slab->owner = cache;
+      slab->size_class = size_class;
+      cache->carve[size_class] = (char*) (slab + 1);
+      cache->carve_end[size_class] = (char*) slab + PT_SLAB_SIZE;
+    }
+    slot = (pt_slab_slot_t*) cache->carve[size_class];
+    cache->carve[size_class] += slot_size;
+  }
+  memset(slot,0,size);
+  return slot;
+#endif
+}
+
+static void slab_free(void* ptr)
+{
+#ifdef PT_NO_SLABS
+  free(ptr);
+#else
+  pt_slab_t* slab = (pt_slab_t*) ((uintptr_t) ptr & ~(uintptr_t) (PT_SLAB_SIZE - 1));
+  pt_slab_slot_t* slot = (pt_slab_slot_t*) ptr;
+  pt_slab_cache_t* owner = slab->owner;
+  unsigned int size_class = slab->size_class;
+  if (owner == slab_cache) {
+    slot->next = owner->free[size_class];
+    owner->free[size_class] = slot;
+  } else {
+    slot->next = __atomic_load_n(&owner->remote[size_class],__ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->remote[size_class],&slot->next,slot,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+      ;
+  }
+#endif
+}
+
+#ifndef PT_NO_SLABS
+/* This thread's slab cache, found the same way as its metrics shard */
+static pt_slab_cache_t* slab_local_cache()
+{
+  pt_slab_cache_t* cache = slab_cache;
+  if (cache)
+    return cache;
+
+  pthread_once(&slab_key_once,slab_make_key);
+  for(cache = __atomic_load_n(&slab_caches,__ATOMIC_ACQUIRE); cache; cache = cache->next) {
+    int unused = 0;
+    if (__atomic_compare_exchange_n(&cache->in_use,&unused,1,0,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+      break;
+  }
+  if (!cache) {
+    cache = (pt_slab_cache_t*) calloc(1,sizeof(pt_slab_cache_t));
+    cache->in_use = 1;
+    cache->next = __atomic_load_n(&slab_caches,__ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slab_caches,&cache->next,cache,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED))
+      ;
+  }
+  slab_cache = cache;
+  pthread_setspecific(slab_key,cache);
+  return cache;
+}
+
+static void slab_make_key()
+{
+  pthread_key_create(&slab_key,slab_thread_exit);
+}
+
+/* Hand the exiting thread's slabs and free lists to the next thread */
+static void slab_thread_exit(void* cache)
+{
+  slab_cache = NULL;
+  __atomic_store_n(&((pt_slab_cache_t*) cache)->in_use,0,__ATOMIC_RELEASE);
+}
+#endif
+
+static pt_arena_t* arena_new()
+{
+  pt_arena_t* arena = (pt_arena_t*) calloc(1,sizeof(pt_arena_t));
+  arena->next_size = PT_ARENA_MIN_BLOCK;
+  return arena;
+}
+
+/*
+ * size bytes of uninitialized memory, aligned for anything a node holds.
+ * Anything big enough to waste much of a block gets one to itself, put
+ * behind the current block so that one keeps filling.
+ */
+static void* arena_alloc(pt_arena_t* arena, size_t size)
+{
+  pt_arena_block_t* block = arena->blocks;
+  size = (size + 7) & ~(size_t) 7;
+  if (!block || block->size - block->used < size) {
+    if (size > arena->next_size / 4) {
+      block = (pt_arena_block_t*) malloc(sizeof(pt_arena_block_t) + size);
+      block->size = block->used = size;
+      if (arena->blocks) {
+        block->next = arena->blocks->next;
+        arena->blocks->next = block;
+      } else {
+        block->next = NULL;
+        arena->blocks = block;
+      }
+      return block + 1;
+    }
+    block = (pt_arena_block_t*) malloc(sizeof(pt_arena_block_t) + arena->next_size);
+    block->size = arena->next_size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    if (arena->next_size < PT_ARENA_MAX_BLOCK)
+      arena->next_size *= 2;
+  }
+  void* ptr = (char*) (block + 1) + block->used;
+  block->used += size;
+  return ptr;
+}
+
+static void arena_free(pt_arena_t* arena)
+{
+  if (arena) {
+    while (arena->blocks) {
+      pt_arena_block_t* block = arena->blocks;
+      arena->blocks = block->next;
+      free(block);
+    }
+    free(arena);
+  }
+}
+
+/* Arena trees can't be changed, and a caller trying to ought to hear about it */
+static int arena_read_only(pt_node_t* node, const char* caller)
+{
+  if (!PT_IN_ARENA(node))
+    return 0;
+  PT_LOG(PT_LOG_WARN,"%s: can't change an arena parsed tree, pt_clone it first",caller);
+  return 1;
+}
+
+/* The hash uthash gives key, so a map's bucket can be found without it */
+static unsigned int key_hash(const char* key, size_t len)
+{
+  unsigned int hashv, bkt;
+  HASH_FCN(key,len,1,hashv,bkt);
+  (void) bkt;
+  return hashv;
+}
+
+/* A key and its text in one block */
+static pt_interned_key_t* interned_key_new(const char* key, size_t len, unsigned int hashv)
+{
+  pt_interned_key_t* interned = (pt_interned_key_t*) malloc(sizeof(pt_interned_key_t) + len + 1);
+  interned->str = (char*) (interned + 1);
+  memcpy(interned->str,key,len);
+  interned->str[len] = 0x0;
+  interned->len = len;
+  interned->hashv = hashv;
+  return interned;
+}
+
+/*
+ * Where key is in the intern table, or NULL with slot set to the empty one
+ * it would go in.  The table is never more than three quarters full, so
+ * there always is one.
+ */
+static pt_interned_key_t* intern_find(const char* key, size_t len, unsigned int hashv, unsigned int* slot)
+{
+  unsigned int i = hashv & (PT_INTERN_SLOTS - 1);
+  pt_interned_key_t* interned;
+  while ((interned = __atomic_load_n(&intern_slots[i],__ATOMIC_ACQUIRE))) {
+    if (interned->hashv == hashv && interned->len == len && !memcmp(interned->str,key,len))
+      return interned;
+    i = (i + 1) & (PT_INTERN_SLOTS - 1);
+  }
+  *slot = i;
+  return NULL;
+}
+
+/*
+ * The interned copy of key, interning it if fewer than limit keys are in
+ * the table, otherwise NULL.  Finding a key takes no lock; adding one does,
+ * and publishes it fully built so readers never see half of it.
+ */
+static pt_interned_key_t* key_intern(const char* key, size_t len, unsigned int hashv, unsigned int limit)
+{
+  unsigned int slot;
+  pt_interned_key_t* interned = intern_find(key,len,hashv,&slot);
+  if (interned || len > PT_INTERN_MAX_LEN || __atomic_load_n(&intern_count,__ATOMIC_RELAXED) >= limit)
+    return interned;
+
+  pthread_mutex_lock(&intern_lock);
+  // somebody may have added it, or taken its slot, since we looked
+  interned = intern_find(key,len,hashv,&slot);
+  if (!interned && intern_count < limit) {
+    interned = interned_key_new(key,len,hashv);
+    __atomic_store_n(&intern_slots[slot],interned,__ATOMIC_RELEASE);
+    __atomic_store_n(&intern_count,intern_count + 1,__ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&intern_lock);
+  return interned;
+}
+
+static pt_stream_parser_t* stream_parser_new()
 {
-  yajl_status stat;
-  yajl_handle hand;
 #ifndef HAVE_YAJL_V2
   yajl_parser_config cfg = { 0, 1 };
 #endif
 
-  pt_parser_ctx_t* parser_ctx = (pt_parser_ctx_t*) calloc(1,sizeof(pt_parser_ctx_t));
+  pt_stream_parser_t* parser = (pt_stream_parser_t*) calloc(1,sizeof(pt_stream_parser_t));
+  parser->ctx = (pt_parser_ctx_t*) calloc(1,sizeof(pt_parser_ctx_t));
 
 #ifdef HAVE_YAJL_V2
-  hand = yajl_alloc(&callbacks, NULL, parser_ctx);
+  parser->hand = yajl_alloc(&callbacks, NULL, parser->ctx);
   // don't allow comments
-  yajl_config(hand, yajl_allow_comments, 0);
+  yajl_config(parser->hand, yajl_allow_comments, 0);
   // DO validate strings
-  yajl_config(hand, yajl_dont_validate_strings, 0);
+  yajl_config(parser->hand, yajl_dont_validate_strings, 0);
 #else
-  hand = yajl_alloc(&callbacks, &cfg, NULL, parser_ctx);
+  parser->hand = yajl_alloc(&callbacks, &cfg, NULL, parser->ctx);
 #endif
+  return parser;
+}
+
+/*
+ * Instead of building up the elements of the top level array called key,
+ * hand each one to callback as soon as it is complete.  The callback owns
+ * the element and returns nonzero to stop parsing.
+ */
+static void stream_parser_rows(pt_stream_parser_t* parser, const char* key, pt_row_callback callback, void* userdata)
+{
+  parser->ctx->stream_key = key;
+  parser->ctx->row_callback = callback;
+  parser->ctx->row_userdata = userdata;
+}
+
+/*
+ * Push the next piece of a json document through the parser.  Once the
+ * document turns out to be malformed the rest of it is ignored.
+ */
+static int stream_parser_feed(pt_stream_parser_t* parser, const char* json, size_t json_len)
+{
+  yajl_status stat;
+  if (parser->failed)
+    return 1;
 
-  stat = yajl_parse(hand, (const unsigned char*) json, json_len);
+  parser->fed += json_len;
+  stat = yajl_parse(parser->hand, (const unsigned char*) json, json_len);
 #ifdef HAVE_YAJL_V2
   if (stat != yajl_status_ok && stat != yajl_status_client_canceled) {
 #else
-  if (stat != yajl_status_ok && stat != yajl_status_insufficient_data) {
+  if (stat != yajl_status_ok && stat != yajl_status_insufficient_data && stat != yajl_status_client_canceled) {
+#endif
+    if (PT_LOG_ENABLED(PT_LOG_WARN)) {
+      unsigned char * str = yajl_get_error(parser->hand, 1, (const unsigned char*) json, json_len);
+      log_write(PT_LOG_WARN,"%s",(const char *) str);
+      yajl_free_error(parser->hand, str);
+    }
+    parser->failed = 1;
+  } else if (stat == yajl_status_client_canceled) {
+    parser->failed = 1;
+  }
+  return parser->failed;
+}
+
+/*
+ * Tear the parser down and hand back whatever tree it managed to build
+ */
+static pt_node_t* stream_parser_finish(pt_stream_parser_t* parser)
+{
+  pt_node_t* root;
+  if (parser->fed > 0 && !parser->failed) {
+#ifdef HAVE_YAJL_V2
+    yajl_status stat = yajl_complete_parse(parser->hand);
+#else
+    yajl_status stat = yajl_parse_complete(parser->hand);
 #endif
-    unsigned char * str = yajl_get_error(hand, 1, (const unsigned char*) json, json_len);
-    fprintf(stderr, "%s",(const char *) str);
-    yajl_free_error(hand, str);
+    if (stat != yajl_status_ok && PT_LOG_ENABLED(PT_LOG_WARN)) {
+      unsigned char * str = yajl_get_error(parser->hand, 0, NULL, 0);
+      log_write(PT_LOG_WARN,"%s",(const char *) str);
+      yajl_free_error(parser->hand, str);
+    }
   }
 
-  pt_node_t* root = parser_ctx->root;
-  free_parser_ctx(parser_ctx);
-  yajl_free(hand);
+  root = parser->ctx->root;
+  free_parser_ctx(parser->ctx);
+  yajl_free(parser->hand);
+  free(parser);
   return root;
 }
 
@@ -844,8 +3817,9 @@ static void free_map_node(pt_map_t* map)
     cur = map->key_values;
     HASH_DEL(map->key_values, cur);
     pt_free_node(cur->value);
-    free(cur->key);
-    free(cur);
+    if (!(cur->parent.flags & (PT_NODE_IN_SITU | PT_NODE_INTERNED)))
+      free(cur->key);
+    slab_free(cur);
   }
 }
 
@@ -856,14 +3830,17 @@ static void free_array_node(pt_array_t* array)
     elem = TAILQ_FIRST(&array->head);
     TAILQ_REMOVE(&array->head, elem, entries);
     pt_free_node(elem->node);
-    free(elem);
+    slab_free(elem);
   }
 }
 
-/* Recursive Free Function.  Watch the fireworks! */
+/*
+ * Recursive Free Function.  Watch the fireworks!  Arena nodes are left for
+ * pt_free_response.
+ */
 void pt_free_node(pt_node_t* node)
 {
-  if (node) {
+  if (node && !PT_IN_ARENA(node)) {
     switch(node->type) {
       case PT_MAP:
         {
@@ -876,13 +3853,14 @@ void pt_free_node(pt_node_t* node)
         }
         break;
       case PT_STRING:
-        free(((pt_str_value_t*) node)->value);
+        if (!(node->flags & PT_NODE_IN_SITU))
+          free(((pt_str_value_t*) node)->value);
         break;
       default:
         break;
-        // the basic value types will get handled in the free(node) below
+        // the basic value types will get handled in the slab_free(node) below
     }
-    free(node);
+    slab_free(node);
   }
 }
 
@@ -2,6 +2,11 @@
 #include "uthash.h"
 #include "utlist.h"
 #include "bsd_queue.h"
+#include <pthread.h>
+#include <curl/curl.h>
+#include <zlib.h>
+#include <yajl/yajl_gen.h>
+#include <yajl/yajl_parse.h>
 
 /* Here we have "subclasses" of pt_node */
 
@@ -61,6 +66,98 @@ typedef struct {
   char* value;
 } pt_str_value_t;
 
+// Set in pt_node_t.flags for nodes carved out of a pt_arena_t
+#define PT_NODE_ARENA 1
+
+#define PT_IN_ARENA(node) ((node)->flags & PT_NODE_ARENA)
+
+// Set for strings and key values whose text points into the response body
+#define PT_NODE_IN_SITU 2
+
+// Set for key values whose key is an interned one, which isn't theirs to free
+#define PT_NODE_INTERNED 4
+
+// Set for integers the parser got that don't fit in an int
+#define PT_NODE_TRUNCATED 8
+
+/*
+ * An interned map key, the object behind a pt_key_t.  Interned keys are
+ * never freed, so any number of maps can share one and have it compared by
+ * address, and the hash uthash files it under is only worked out once.
+ */
+typedef struct {
+  char* str;
+  size_t len;
+  unsigned int hashv;
+} pt_interned_key_t;
+
+/*
+ * The intern table is open addressed and never grows or loses an entry, so
+ * lookups take no lock and only adding a key does.  Parsed keys stop being
+ * interned once PT_INTERN_PARSED_KEYS are in, so maps keyed by something like
+ * doc ids can't fill it; pt_key_intern may go on to PT_INTERN_MAX_KEYS, after
+ * which it returns NULL.
+ */
+#define PT_INTERN_SLOTS 8192
+#define PT_INTERN_PARSED_KEYS (PT_INTERN_SLOTS / 2)
+#define PT_INTERN_MAX_KEYS (PT_INTERN_SLOTS * 3 / 4)
+#define PT_INTERN_MAX_LEN 128 // longer keys are likely data rather than field names
+
+/*
+ * A bump allocator for one response's tree.  Nothing in it is freed on its
+ * own; the blocks all go at once.
+ */
+typedef struct pt_arena_block_t {
+  struct pt_arena_block_t* next;
+  size_t used;
+  size_t size;
+} pt_arena_block_t;
+
+typedef struct {
+  pt_arena_block_t* blocks; // the one being filled first
+  size_t next_size;
+} pt_arena_t;
+
+// Arena blocks start this big and double up to the max
+#define PT_ARENA_MIN_BLOCK (16 * 1024)
+#define PT_ARENA_MAX_BLOCK (1024 * 1024)
+
+/*
+ * Nodes and array elements that aren't in an arena come from per thread
+ * slabs, one free list per 16 byte size class.  Slabs are aligned to their
+ * size so a node can find its slab, and through it the cache of the thread
+ * that carved it.  Freeing a node on that thread puts it straight back on
+ * the free list; any other thread pushes it onto the owner's remote list,
+ * which the owner takes over whole when its own list runs dry.  Like
+ * metrics shards, caches are never freed and the cache of a thread that
+ * exits goes to the next new thread, slabs and all.  Slab memory is kept for
+ * reuse rather than given back.
+ *
+ * Build with -DPT_NO_SLABS to use plain malloc instead, e.g. under valgrind.
+ */
+#define PT_SLAB_SIZE (16 * 1024)
+#define PT_SLAB_CLASS_BYTES 16
+#define PT_SLAB_CLASSES 6 // up to 96 bytes, which covers a pt_key_value_t
+
+typedef struct pt_slab_slot_t {
+  struct pt_slab_slot_t* next;
+} pt_slab_slot_t;
+
+typedef struct pt_slab_cache_t {
+  pt_slab_slot_t* free[PT_SLAB_CLASSES];
+  pt_slab_slot_t* remote[PT_SLAB_CLASSES]; // freed by other threads
+  char* carve[PT_SLAB_CLASSES];            // the untouched rest of the newest slab
+  char* carve_end[PT_SLAB_CLASSES];
+  int in_use;
+  struct pt_slab_cache_t* next;
+} pt_slab_cache_t;
+
+/* The start of every slab, followed by its slots */
+typedef struct {
+  pt_slab_cache_t* owner;
+  unsigned int size_class;
+} __attribute__((aligned(PT_SLAB_CLASS_BYTES))) pt_slab_t;
+
 /* This is useful for a stack of containers so we can know where we are */
 typedef struct pt_container_ctx_t {
   pt_node_t* container;
@@ -68,15 +165,282 @@ typedef struct pt_container_ctx_t {
   struct pt_container_ctx_t *next;//, *prev;
 }pt_container_ctx_t;
 
+typedef int (*pt_row_callback)(pt_node_t* row, void* userdata);
+
 /* Implementation Structure of pt_response_t */
 typedef struct {
   pt_node_t* root;
   pt_container_ctx_t* stack;
+  pt_container_ctx_t* spare; // popped off the stack, for the next container
+  pt_arena_t* arena;         // where the tree goes, NULL for the heap
+  char* in_situ;             // the body strings are left in, when parsing in situ
+  size_t in_situ_len;
+  yajl_handle hand;          // to find where unescaped strings were, in situ
+  int intern_keys;           // keys share the interned copies
+
+  /* set to stream the elements of a top level array, like a view's "rows" */
+  const char* stream_key;
+  pt_node_t* stream_array;
+  pt_node_t* stream_row;   // the element currently being built
+  pt_row_callback row_callback;
+  void* row_userdata;
+  int stopped;
 } pt_parser_ctx_t;
 
+/* A json parser that builds its tree while the document is still arriving */
+typedef struct {
+  yajl_handle hand;
+  pt_parser_ctx_t* ctx;
+  size_t fed;
+  int failed;
+} pt_stream_parser_t;
+
 typedef struct {
   pt_iterator_type type;
   pt_array_elem_t* next_array_elem;
   pt_key_value_t* next_map_pair;
 } pt_iterator_impl_t;
 
+
+/* A curl handle that can be parked in a session between requests */
+typedef struct pt_pooled_handle_t {
+  CURL* curl;
+  CURLM* multi;    // for racing a hedged GET against its twin, made on first use
+  char* host;
+  size_t host_len;
+  pthread_t owner; // the thread that used it last
+  struct pt_pooled_handle_t *prev, *next;
+} pt_pooled_handle_t;
+
+struct memory_chunk {
+  char *memory;
+  char *offset;
+  size_t size;
+  size_t capacity;
+};
+
+// Messages above this level are compiled out
+#ifndef PT_LOG_MAX_LEVEL
+#define PT_LOG_MAX_LEVEL PT_LOG_DEBUG
+#endif
+
+// Default for PT_OPT_MAX_CONNECTIONS
+#define PT_DEFAULT_MAX_CONNECTIONS 32
+
+// Default for PT_OPT_CONNECT_TIMEOUT_MS
+#define PT_DEFAULT_CONNECT_TIMEOUT_MS 10000
+
+// Default for PT_OPT_RETRY_BACKOFF_MS, and the longest a retry waits
+#define PT_DEFAULT_RETRY_BACKOFF_MS 100
+#define PT_RETRY_BACKOFF_MAX_MS 10000
+
+// GETs a session times before it starts hedging, and how many it remembers
+#define PT_HEDGE_MIN_SAMPLES 20
+// Never hedge sooner than this, or every GET to a fast local server gets two copies
+#define PT_HEDGE_MIN_DELAY_MS 1
+#define PT_HEDGE_WINDOW 1000
+
+// Receive buffers start this big and double from there
+#define PT_RECV_MIN_CAPACITY 4096
+
+// Anything bigger is freed rather than kept in a session's buffer pool
+#define PT_POOLED_BUFFER_MAX (8 * 1024 * 1024)
+
+typedef struct {
+  char* memory;
+  size_t capacity;
+} pt_pooled_buffer_t;
+
+/*
+ * Receive buffers given back by pt_free_response for later requests to
+ * reuse.  Responses can outlive their session, so the pool is refcounted by
+ * the session and by every response holding one of its buffers.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  unsigned int refcount;
+  unsigned int count;
+  unsigned int max_buffers;
+  pt_pooled_buffer_t* buffers;
+} pt_buffer_pool_t;
+
+/* What a pt_response_t really is */
+typedef struct {
+  pt_response_t response;
+  pt_buffer_pool_t* pool;   // where raw_json goes back to, if anywhere
+  size_t raw_json_capacity;
+  pt_arena_t* arena;        // holds root, if it was parsed into one
+  char* body;               // what root's strings point into, in place of raw_json
+} pt_response_impl_t;
+
+/* A parsed GET response kept for revalidation with If-None-Match */
+typedef struct pt_cache_entry_t {
+  char* url;
+  char* etag;
+  pt_node_t* root;
+  size_t bytes;   // roughly what the entry costs, counted against the budget
+  int refs;       // one for being in the cache, plus one per request using it
+  UT_hash_handle hh;
+  struct pt_cache_entry_t *prev, *next; // most recently used first
+} pt_cache_entry_t;
+
+/* A GET that other threads asking for the same url are waiting on */
+typedef struct pt_flight_t {
+  char* url;
+  pt_response_t* res;   // what came back, once finished is set
+  int finished;
+  int refs;             // the thread making the request plus its waiters
+  pthread_cond_t finished_cond;
+  UT_hash_handle hh;
+} pt_flight_t;
+
+struct pt_session_impl_t;
+
+/* One HTTP exchange, either run inline or queued on a session's multi handle */
+typedef struct pt_request_t {
+  struct pt_session_impl_t* session;
+  pt_pooled_handle_t* handle;
+  struct memory_chunk recv_chunk;
+  struct memory_chunk send_chunk; // offset walks the caller's body, memory is set if we own it
+  const char* send_start;     // the whole body, for curl to rewind to when it resends
+  size_t send_len;
+  struct curl_slist* headers;
+  z_stream* gzip;             // set while a compressed body is being sent
+  pt_buffer_pool_t* pool;     // the session's receive buffers, if it keeps any
+  pt_metric_t method_metric;
+  unsigned long long start_us; // when the request was made, if metrics are on
+  double parse_time;          // time spent in the stream parser so far
+  double serialize_time;      // time it took to build the body
+  pt_stream_parser_t* parser; // set when the body is parsed as it arrives
+  pt_arena_t* arena;          // what the response is parsed into, if the session wants
+  int retain_raw;
+  int parse;
+  int in_multi;
+  int cut_short;              // the transfer was abandoned, so its connection can't be reused
+  int idempotent;             // a GET that is safe to send more than once
+  int retries_left;
+  int attempts;               // retries made so far, for the backoff
+  long long deadline_ms;      // PT_OPT_TIMEOUT_MS from when it was made, 0 for none
+  long long not_before_ms;    // a queued retry waits until then
+  long long hedge_at_ms;      // when an async GET gets its second copy, 0 for never
+  char* hedge_url;            // set when the session hedges this request
+  struct pt_request_t* twin;  // the other copy of a hedged GET
+  int is_twin;
+  int parked;                 // failed while its twin still runs, settled when the twin ends
+  char* cache_url;            // set when the response can go in the session's cache
+  pt_cache_entry_t* cached;   // the copy If-None-Match asked about
+  char* etag;                 // from the response headers
+  int fd;                     // where an attachment is streamed to or from
+  off_t fd_start;             // where an upload from fd began, -1 if it can't seek
+  void* mapped;               // an mmapped attachment being uploaded
+  size_t mapped_len;
+  pt_async_callback callback;
+  void* userdata;
+  struct pt_request_t *prev, *next;
+} pt_request_t;
+
+/*
+ * Implementation Structure of pt_session_t.  lock covers the idle handles,
+ * the GET latencies, the cache and the flights; the async queues belong to
+ * whichever thread drives pt_session_perform.
+ */
+typedef struct pt_session_impl_t {
+  pthread_mutex_t lock;
+  CURLSH* share; // DNS and TLS session caches for all its handles
+  pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+  pt_pooled_handle_t* idle; // most recently used first
+  unsigned int idle_count;
+  unsigned int max_pool_size;
+
+  CURLM* multi;
+  pt_request_t* running;
+  pt_request_t* pending;
+  unsigned int inflight;
+  unsigned int pending_count;
+  unsigned int max_inflight;
+
+  int stream_parse;
+  int retain_raw_json;
+  int accept_encoding;
+  long gzip_min_size;
+  pt_buffer_pool_t* buffer_pool;
+  long max_connections;
+  pt_http_version_t http_version;
+  long timeout_ms;
+  long connect_timeout_ms;
+  int retries;
+  long retry_backoff_ms;
+  int hedge_percentile;
+  pt_histogram_t get_latency; // recent GET times for the hedge delay, under lock
+
+  pt_cache_entry_t* cache;     // by url, under lock
+  pt_cache_entry_t* cache_lru;
+  size_t cache_used;
+  size_t cache_budget;
+
+  char* unix_socket;
+  int coalesce_gets;
+  int arena_parse;
+  int in_situ_strings;
+  int intern_keys;
+  pt_flight_t* flights;        // GETs in progress by url, under lock
+} pt_session_impl_t;
+
+/* Implementation Structure of pt_bulk_writer_t */
+typedef struct {
+  pt_session_impl_t* session;
+  char* url;
+  unsigned int max_docs;
+  unsigned int max_bytes;
+  unsigned int max_delay_ms;
+  pt_bulk_write_callback callback;
+  void* userdata;
+
+  yajl_gen gen;        // the _bulk_docs body being built
+  unsigned int count;
+  char** ids;          // ids of buffered docs, for reporting failures
+  unsigned int ids_capacity;
+  long long first_add_ms;
+} pt_bulk_writer_impl_t;
+
+/* State of a pt_changes_follow call */
+typedef struct {
+  const pt_changes_opts_t* opts;
+  pt_changes_callback callback;
+  void* userdata;
+  CURL* curl;
+  long status;
+  pt_stream_parser_t* parser; // the change (or longpoll body) being parsed
+  char* last_seq;
+  int stopped;
+  int seq_overflow;           // a seq didn't fit in an int, so there's no resuming
+} pt_changes_ctx_t;
+
+typedef struct pt_view_row_t {
+  pt_node_t* row;
+  struct pt_view_row_t *prev, *next;
+} pt_view_row_t;
+
+/* Implementation Structure of pt_view_t */
+typedef struct {
+  CURLM* multi;
+  pt_request_t* req;
+  pt_view_row_t* rows;   // parsed but not yet returned by pt_view_next
+  pt_node_t* current;    // the row pt_view_next handed out last
+  int done;
+  CURLcode result;
+} pt_view_impl_t;
+
+/*
+ * One thread's metrics.  Only the owning thread writes to a shard, so
+ * recording is a couple of relaxed stores; snapshots read every shard.
+ * Shards are never freed, a thread that exits leaves its shard for the next
+ * new thread to pick up.
+ */
+typedef struct pt_metrics_shard_t {
+  pt_histogram_t histograms[PT_METRIC_COUNT];
+  unsigned long long counters[PT_COUNTER_COUNT];
+  int in_use;
+  struct pt_metrics_shard_t* next;
+} pt_metrics_shard_t;
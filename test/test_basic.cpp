@@ -1,6 +1,9 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <cstdio>
+#include <pthread.h>
+#include <unistd.h>
 
 #define BOOST_TEST_MAIN
 #include <boost/test/included/unit_test.hpp> 
@@ -98,6 +101,812 @@ BOOST_AUTO_TEST_CASE( test_updates_to_document )
   }
 }
 
+BOOST_AUTO_TEST_CASE( test_session )
+{
+  pt_session_t* session = pt_session_new(4);
+  BOOST_REQUIRE(session);
+  for(int i=0; i < 3; i++) {
+    pt_response_t* res = pt_session_get(session,"http://localhost:5984/pt_test/basic");
+    BOOST_REQUIRE_EQUAL(res->response_code,200);
+    BOOST_REQUIRE_EQUAL(pt_string_get(pt_map_get(res->root,"_id")),"basic");
+    pt_free_response(res);
+  }
+
+  pt_node_t* doc = pt_map_new();
+  pt_map_set(doc,"name",pt_string_new("pooled"));
+  pt_response_t* res = pt_session_put(session,"http://localhost:5984/pt_test/session_doc",doc);
+  BOOST_REQUIRE_EQUAL(res->response_code,201);
+  pt_free_response(res);
+  pt_free_node(doc);
+
+  res = pt_session_get(session,"http://localhost:5984/pt_test/session_doc");
+  BOOST_REQUIRE_EQUAL(pt_string_get(pt_map_get(res->root,"name")),"pooled");
+  pt_free_response(res);
+  pt_session_free(session);
+}
+
+static void count_ok_callback(pt_response_t* res, void* userdata)
+{
+  int* ok = (int*) userdata;
+  if (res->response_code == 200 && pt_array_len(pt_map_get(res->root,"a")) == 3)
+    (*ok)++;
+  pt_free_response(res);
+}
+
+BOOST_AUTO_TEST_CASE( test_async )
+{
+  pt_session_t* session = pt_session_new(4);
+  BOOST_REQUIRE_EQUAL(pt_session_setopt(session,PT_OPT_MAX_INFLIGHT,3),0);
+  int ok = 0;
+  for(int i=0; i < 20; i++) {
+    BOOST_REQUIRE(pt_async_get(session,"http://localhost:5984/pt_test/array",count_ok_callback,&ok));
+  }
+  pt_async_t* cancelled = pt_async_get(session,"http://localhost:5984/pt_test/array",count_ok_callback,&ok);
+  pt_async_cancel(session,cancelled);
+  pt_session_wait(session);
+  BOOST_REQUIRE_EQUAL(ok,20);
+  pt_session_free(session);
+}
+
+BOOST_AUTO_TEST_CASE( test_bulk_get )
+{
+  const char* ids[] = {"basic","missing","array"};
+  pt_bulk_get_result_t* result = pt_bulk_get(NULL,"http://localhost:5984/pt_test",ids,3);
+  BOOST_REQUIRE(result);
+  BOOST_REQUIRE_EQUAL(result->response_code,200);
+  BOOST_REQUIRE_EQUAL(result->len,3);
+
+  BOOST_REQUIRE(!result->docs[0].error);
+  BOOST_REQUIRE_EQUAL(pt_string_get(pt_map_get(result->docs[0].doc,"_id")),"basic");
+
+  BOOST_REQUIRE(!result->docs[1].doc);
+  BOOST_REQUIRE_EQUAL(result->docs[1].error,"not_found");
+
+  BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(result->docs[2].doc,"a")),3);
+  pt_free_bulk_get_result(result);
+
+  // a deleted doc comes back as a null doc, which still says why
+  const char* doc = "{}";
+  pt_response_t* res = pt_put_raw("http://localhost:5984/pt_test/bulk_deleted",doc,strlen(doc));
+  string url = string("http://localhost:5984/pt_test/bulk_deleted?rev=") + pt_string_get(pt_map_get(res->root,"rev"));
+  pt_free_response(res);
+  pt_free_response(pt_delete(url.c_str()));
+  const char* deleted[] = {"bulk_deleted"};
+  result = pt_bulk_get(NULL,"http://localhost:5984/pt_test",deleted,1);
+  BOOST_REQUIRE(!result->docs[0].doc);
+  BOOST_REQUIRE_EQUAL(result->docs[0].error,"deleted");
+  pt_free_bulk_get_result(result);
+}
+
+struct BulkCounts {
+  int saved;
+  int conflicts;
+};
+
+static void bulk_write_callback(const char* id, const char* rev, const char* error, void* userdata)
+{
+  BulkCounts* counts = (BulkCounts*) userdata;
+  if (rev && !error)
+    counts->saved++;
+  else if (error && !strcmp(error,"conflict") && id && !strcmp(id,"basic"))
+    counts->conflicts++;
+}
+
+BOOST_AUTO_TEST_CASE( test_bulk_writer )
+{
+  BulkCounts counts = {0,0};
+  pt_bulk_writer_t* writer = pt_bulk_writer_new(NULL,"http://localhost:5984/pt_test",3,0,0,bulk_write_callback,&counts);
+  BOOST_REQUIRE(writer);
+  for(int i=0; i < 7; i++) {
+    pt_node_t* doc = pt_map_new();
+    pt_map_set(doc,"n",pt_integer_new(i));
+    BOOST_REQUIRE_EQUAL(pt_bulk_writer_add(writer,doc),0);
+    pt_free_node(doc);
+  }
+  BOOST_REQUIRE_EQUAL(counts.saved,6);
+
+  // basic already exists so this one has to come back as a conflict
+  pt_node_t* conflict = pt_map_new();
+  pt_map_set(conflict,"_id",pt_string_new("basic"));
+  pt_bulk_writer_add(writer,conflict);
+  pt_free_node(conflict);
+
+  pt_bulk_writer_free(writer);
+  BOOST_REQUIRE_EQUAL(counts.saved,7);
+  BOOST_REQUIRE_EQUAL(counts.conflicts,1);
+}
+
+struct BulkFailures {
+  int results;
+  int not_found;
+};
+
+static void bulk_fail_callback(const char* id, const char* rev, const char* error, void* userdata)
+{
+  BulkFailures* failures = (BulkFailures*) userdata;
+  failures->results++;
+  if (!rev && error && !strcmp(error,"not_found"))
+    failures->not_found++;
+}
+
+BOOST_AUTO_TEST_CASE( test_bulk_writer_missing_db )
+{
+  BulkFailures failures = {0,0};
+  pt_bulk_writer_t* writer = pt_bulk_writer_new(NULL,"http://localhost:5984/pt_test_missing",0,0,0,bulk_fail_callback,&failures);
+  for(int i=0; i < 3; i++) {
+    pt_node_t* doc = pt_map_new();
+    pt_map_set(doc,"n",pt_integer_new(i));
+    pt_bulk_writer_add(writer,doc);
+    pt_free_node(doc);
+  }
+  // the server's error map is the answer for every doc, not the first one's result
+  BOOST_REQUIRE(pt_bulk_writer_flush(writer) != 0);
+  BOOST_REQUIRE_EQUAL(failures.results,3);
+  BOOST_REQUIRE_EQUAL(failures.not_found,3);
+  pt_bulk_writer_free(writer);
+  BOOST_REQUIRE_EQUAL(failures.results,3);
+}
+
+BOOST_AUTO_TEST_CASE( test_stream_parse )
+{
+  pt_session_t* session = pt_session_new(1);
+  pt_session_setopt(session,PT_OPT_STREAM_PARSE,1);
+  pt_response_t* res = pt_session_get(session,"http://localhost:5984/pt_test/array");
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"a")),3);
+  BOOST_REQUIRE(res->raw_json);
+  pt_free_response(res);
+
+  pt_session_setopt(session,PT_OPT_RETAIN_RAW_JSON,0);
+  res = pt_session_get(session,"http://localhost:5984/pt_test/array");
+  BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"a")),3);
+  BOOST_REQUIRE(!res->raw_json);
+  pt_free_response(res);
+  pt_session_free(session);
+}
+
+static int count_changes_callback(pt_node_t* change, void* userdata)
+{
+  int* seen = (int*) userdata;
+  BOOST_REQUIRE(pt_map_get(change,"id"));
+  BOOST_REQUIRE(pt_map_get(change,"seq"));
+  return ++(*seen) == 3;
+}
+
+BOOST_AUTO_TEST_CASE( test_changes_follow )
+{
+  int seen = 0;
+  pt_changes_opts_t opts = {0,0,1000,NULL,0};
+  BOOST_REQUIRE_EQUAL(pt_changes_follow(NULL,"http://localhost:5984/pt_test","0",&opts,count_changes_callback,&seen),0);
+  BOOST_REQUIRE_EQUAL(seen,3);
+
+  seen = 0;
+  opts.longpoll = 1;
+  BOOST_REQUIRE_EQUAL(pt_changes_follow(NULL,"http://localhost:5984/pt_test","0",&opts,count_changes_callback,&seen),0);
+  BOOST_REQUIRE_EQUAL(seen,3);
+
+  BOOST_REQUIRE_EQUAL(pt_changes_follow(NULL,"http://localhost:5984/pt_no_such_db",NULL,&opts,count_changes_callback,&seen),404);
+}
+
+BOOST_AUTO_TEST_CASE( test_post_raw )
+{
+  const char* doc = "{\"posted\":true}";
+  pt_response_t* res = pt_post_raw("http://localhost:5984/pt_test",doc,strlen(doc));
+  BOOST_REQUIRE_EQUAL(res->response_code,201);
+  pt_node_t* id = pt_map_get(res->root,"id");
+  BOOST_REQUIRE(id);
+  string url = string("http://localhost:5984/pt_test/") + pt_string_get(id);
+  pt_free_response(res);
+
+  res = pt_get(url.c_str());
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE(pt_boolean_get(pt_map_get(res->root,"posted")));
+  pt_free_response(res);
+}
+
+BOOST_AUTO_TEST_CASE( test_gzip_requests )
+{
+  pt_session_t* session = pt_session_new(1);
+  pt_session_setopt(session,PT_OPT_GZIP_MIN_SIZE,1);
+
+  pt_node_t* doc = pt_map_new();
+  pt_node_t* ary = pt_array_new();
+  for(int i = 0; i < 10000; i++)
+    pt_array_push_back(ary,pt_integer_new(i));
+  pt_map_set(doc,"numbers",ary);
+  pt_response_t* res = pt_session_put(session,"http://localhost:5984/pt_test/gzipped",doc);
+  BOOST_REQUIRE_EQUAL(res->response_code,201);
+  pt_free_response(res);
+  pt_free_node(doc);
+
+  const char* posted = "{\"gzipped\":true}";
+  res = pt_session_post_raw(session,"http://localhost:5984/pt_test",posted,strlen(posted));
+  BOOST_REQUIRE_EQUAL(res->response_code,201);
+  pt_free_response(res);
+
+  res = pt_session_get(session,"http://localhost:5984/pt_test/gzipped");
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"numbers")),10000);
+  pt_free_response(res);
+  pt_session_free(session);
+}
+
+// PUT a document holding the numbers 0 to count-1 at url
+static void put_numbers(const char* url, int count)
+{
+  pt_node_t* doc = pt_map_new();
+  pt_node_t* ary = pt_array_new();
+  for(int i = 0; i < count; i++)
+    pt_array_push_back(ary,pt_integer_new(i));
+  pt_map_set(doc,"numbers",ary);
+  pt_response_t* res = pt_put(url,doc);
+  BOOST_REQUIRE_EQUAL(res->response_code,201);
+  pt_free_response(res);
+  pt_free_node(doc);
+}
+
+BOOST_AUTO_TEST_CASE( test_buffer_pool )
+{
+  put_numbers("http://localhost:5984/pt_test/pooled",10000);
+  pt_session_t* session = pt_session_new(1);
+  pt_session_setopt(session,PT_OPT_BUFFER_POOL,2);
+  pt_response_t* first = pt_session_get(session,"http://localhost:5984/pt_test/pooled");
+  BOOST_REQUIRE_EQUAL(first->response_code,200);
+  string body(first->raw_json,first->raw_json_len);
+  const char* buffer = first->raw_json;
+  pt_free_response(first);
+
+  // the next response reuses the buffer the first one gave back
+  pt_response_t* second = pt_session_get(session,"http://localhost:5984/pt_test/pooled");
+  BOOST_REQUIRE_EQUAL(second->raw_json,buffer);
+  BOOST_REQUIRE_EQUAL(string(second->raw_json,second->raw_json_len),body);
+  BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(second->root,"numbers")),10000);
+
+  // responses can outlive the session
+  pt_session_free(session);
+  pt_free_response(second);
+}
+
+BOOST_AUTO_TEST_CASE( test_timing )
+{
+  put_numbers("http://localhost:5984/pt_test/timed",10000);
+  pt_response_t* res = pt_get("http://localhost:5984/pt_test/timed");
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE(res->timing.total > 0);
+  BOOST_REQUIRE(res->timing.connect <= res->timing.starttransfer);
+  BOOST_REQUIRE(res->timing.starttransfer <= res->timing.total);
+  BOOST_REQUIRE(res->timing.parse > 0);
+  BOOST_REQUIRE(res->timing.bytes_received > res->raw_json_len);
+  BOOST_REQUIRE(res->timing.bytes_sent > 0);
+
+  pt_node_t* doc = res->root;
+  res->root = NULL;
+  pt_free_response(res);
+  res = pt_put("http://localhost:5984/pt_test/timed",doc);
+  BOOST_REQUIRE_EQUAL(res->response_code,201);
+  BOOST_REQUIRE(res->timing.serialize > 0);
+  BOOST_REQUIRE(res->timing.bytes_sent > 10000);
+  pt_free_response(res);
+  pt_free_node(doc);
+}
+
+static void* parse_in_thread(void* unused)
+{
+  for(int i = 0; i < 100; i++)
+    pt_free_node(pt_from_json("{\"a\":[1,2,3]}"));
+  return NULL;
+}
+
+BOOST_AUTO_TEST_CASE( test_metrics )
+{
+  pt_metrics_enable(1);
+  pt_metrics_t* before = pt_metrics_snapshot();
+
+  pt_session_t* session = pt_session_new(1);
+  for(int i = 0; i < 2; i++)
+    pt_free_response(pt_session_get(session,"http://localhost:5984/pt_test/array"));
+  pt_session_free(session);
+
+  pt_node_t* doc = pt_from_json("{\"a\":{\"b\":1}}");
+  pt_node_t* copy = pt_clone(doc);
+  pt_map_update(copy,doc,0);
+  free(pt_to_json(copy,0));
+  pt_free_node(copy);
+  pt_free_node(doc);
+
+  pthread_t threads[4];
+  for(int i = 0; i < 4; i++)
+    pthread_create(&threads[i],NULL,parse_in_thread,NULL);
+  for(int i = 0; i < 4; i++)
+    pthread_join(threads[i],NULL);
+
+  pt_metrics_t* after = pt_metrics_snapshot();
+  pt_metrics_enable(0);
+
+  BOOST_REQUIRE_EQUAL(after->histograms[PT_METRIC_GET].count - before->histograms[PT_METRIC_GET].count,2);
+  BOOST_REQUIRE_EQUAL(after->counters[PT_COUNTER_REQUESTS] - before->counters[PT_COUNTER_REQUESTS],2);
+  BOOST_REQUIRE_EQUAL(after->counters[PT_COUNTER_CONNECTIONS_OPENED] - before->counters[PT_COUNTER_CONNECTIONS_OPENED],1);
+  BOOST_REQUIRE_EQUAL(after->counters[PT_COUNTER_CONNECTIONS_REUSED] - before->counters[PT_COUNTER_CONNECTIONS_REUSED],1);
+  BOOST_REQUIRE(after->counters[PT_COUNTER_BYTES_RECEIVED] > before->counters[PT_COUNTER_BYTES_RECEIVED]);
+  // 2 responses, 1 document and 400 from the threads
+  BOOST_REQUIRE_EQUAL(after->histograms[PT_METRIC_PARSE].count - before->histograms[PT_METRIC_PARSE].count,403);
+  BOOST_REQUIRE_EQUAL(after->histograms[PT_METRIC_CLONE].count - before->histograms[PT_METRIC_CLONE].count,1);
+  BOOST_REQUIRE_EQUAL(after->histograms[PT_METRIC_MERGE].count - before->histograms[PT_METRIC_MERGE].count,1);
+  BOOST_REQUIRE_EQUAL(after->histograms[PT_METRIC_GENERATE].count - before->histograms[PT_METRIC_GENERATE].count,1);
+
+  const pt_histogram_t* get = &after->histograms[PT_METRIC_GET];
+  BOOST_REQUIRE(pt_histogram_percentile(get,50) >= get->min_us);
+  BOOST_REQUIRE(pt_histogram_percentile(get,100) <= get->max_us);
+  pt_free_metrics(before);
+  pt_free_metrics(after);
+}
+
+static void collect_log(pt_log_level_t level, const char* message, void* userdata)
+{
+  ((vector<string>*) userdata)->push_back(message);
+}
+
+BOOST_AUTO_TEST_CASE( test_logging )
+{
+  vector<string> messages;
+  pt_set_log(PT_LOG_DEBUG,collect_log,&messages);
+  pt_free_response(pt_get("http://localhost:5984/pt_test/array"));
+  BOOST_REQUIRE_EQUAL(messages.size(),1);
+  BOOST_REQUIRE_EQUAL(messages[0],"GET http://localhost:5984/pt_test/array");
+
+  pt_set_log(PT_LOG_WARN,collect_log,&messages);
+  pt_free_response(pt_get("http://localhost:5984/pt_test/array"));
+  BOOST_REQUIRE_EQUAL(messages.size(),1);
+  pt_free_node(pt_from_json("{\"broken\":"));
+  BOOST_REQUIRE_EQUAL(messages.size(),2);
+
+  pt_set_log(PT_LOG_OFF,NULL,NULL);
+  pt_free_node(pt_from_json("{\"broken\":"));
+  BOOST_REQUIRE_EQUAL(messages.size(),2);
+}
+
+static void count_ok(pt_response_t* res, void* userdata)
+{
+  if (res->response_code == 200)
+    (*(int*) userdata)++;
+  pt_free_response(res);
+}
+
+BOOST_AUTO_TEST_CASE( test_http_version )
+{
+  pt_session_t* session = pt_session_new(2);
+  BOOST_REQUIRE(pt_session_setopt(session,PT_OPT_HTTP_VERSION,42));
+  BOOST_REQUIRE(!pt_session_setopt(session,PT_OPT_HTTP_VERSION,PT_HTTP_1_1));
+  pt_response_t* res = pt_session_get(session,"http://localhost:5984/pt_test/array");
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  pt_free_response(res);
+
+  // without tls PT_HTTP_2 falls back to HTTP/1.1 for servers like couch
+  int ok = 0;
+  BOOST_REQUIRE(!pt_session_setopt(session,PT_OPT_HTTP_VERSION,PT_HTTP_2));
+  pt_session_setopt(session,PT_OPT_MAX_INFLIGHT,4);
+  for(int i = 0; i < 8; i++)
+    pt_async_get(session,"http://localhost:5984/pt_test/array",count_ok,&ok);
+  pt_session_wait(session);
+  BOOST_REQUIRE_EQUAL(ok,8);
+  pt_session_free(session);
+}
+
+static void collect_code(pt_response_t* res, void* userdata)
+{
+  ((vector<long>*) userdata)->push_back(res->response_code);
+  pt_free_response(res);
+}
+
+BOOST_AUTO_TEST_CASE( test_timeouts_and_retries )
+{
+  pt_session_t* session = pt_session_new(2);
+  pt_session_setopt(session,PT_OPT_TIMEOUT_MS,200);
+  // a longpoll with nothing to report hangs until its own timeout
+  pt_response_t* res = pt_session_get(session,"http://localhost:5984/pt_test/_changes?feed=longpoll&since=now&timeout=5000");
+  BOOST_REQUIRE_EQUAL(res->response_code,500);
+  BOOST_REQUIRE(res->timing.total < 1);
+  pt_free_response(res);
+
+  pt_metrics_enable(1);
+  pt_metrics_t* before = pt_metrics_snapshot();
+  pt_session_setopt(session,PT_OPT_TIMEOUT_MS,0);
+  pt_session_setopt(session,PT_OPT_RETRIES,2);
+  pt_session_setopt(session,PT_OPT_RETRY_BACKOFF_MS,10);
+  // nothing listens on port 1
+  res = pt_session_get(session,"http://127.0.0.1:1/pt_test");
+  BOOST_REQUIRE_EQUAL(res->response_code,500);
+  pt_free_response(res);
+  vector<long> codes;
+  pt_async_get(session,"http://127.0.0.1:1/pt_test",collect_code,&codes);
+  pt_session_wait(session);
+  BOOST_REQUIRE_EQUAL(codes.size(),1);
+  BOOST_REQUIRE_EQUAL(codes[0],500);
+  // writes are never retried
+  pt_free_response(pt_session_put_raw(session,"http://127.0.0.1:1/pt_test/doc","{}",2));
+  pt_metrics_t* after = pt_metrics_snapshot();
+  pt_metrics_enable(0);
+
+  BOOST_REQUIRE_EQUAL(after->counters[PT_COUNTER_RETRIES] - before->counters[PT_COUNTER_RETRIES],4);
+  pt_free_metrics(before);
+  pt_free_metrics(after);
+  pt_session_free(session);
+}
+
+BOOST_AUTO_TEST_CASE( test_hedging )
+{
+  const char* longpoll = "http://localhost:5984/pt_test/_changes?feed=longpoll&since=now&timeout=300";
+  pt_metrics_enable(1);
+  pt_metrics_t* before = pt_metrics_snapshot();
+  pt_session_t* session = pt_session_new(4);
+  BOOST_REQUIRE(pt_session_setopt(session,PT_OPT_HEDGE_PERCENTILE,100));
+  BOOST_REQUIRE(!pt_session_setopt(session,PT_OPT_HEDGE_PERCENTILE,95));
+  for(int i = 0; i < 20; i++)
+    pt_free_response(pt_session_get(session,"http://localhost:5984/pt_test/array"));
+
+  // both copies of a longpoll wait it out, but only one answer comes back
+  pt_response_t* res = pt_session_get(session,longpoll);
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE(pt_map_get(res->root,"last_seq"));
+  pt_free_response(res);
+  vector<long> codes;
+  pt_async_get(session,longpoll,collect_code,&codes);
+  pt_session_wait(session);
+  BOOST_REQUIRE_EQUAL(codes.size(),1);
+  BOOST_REQUIRE_EQUAL(codes[0],200);
+
+  pt_metrics_t* after = pt_metrics_snapshot();
+  pt_metrics_enable(0);
+  BOOST_REQUIRE_EQUAL(after->counters[PT_COUNTER_HEDGES] - before->counters[PT_COUNTER_HEDGES],2);
+  pt_free_metrics(before);
+  pt_free_metrics(after);
+  pt_session_free(session);
+}
+
+BOOST_AUTO_TEST_CASE( test_cache )
+{
+  const char* url = "http://localhost:5984/pt_test/cached_doc";
+  const char* doc = "{\"hot\":true,\"list\":[1,2,3]}";
+  pt_free_response(pt_put_raw(url,doc,strlen(doc)));
+  pt_metrics_enable(1);
+  pt_metrics_t* before = pt_metrics_snapshot();
+  pt_session_t* session = pt_session_new(2);
+  pt_session_setopt(session,PT_OPT_CACHE_BYTES,1 << 20);
+
+  pt_response_t* first = pt_session_get(session,url);
+  BOOST_REQUIRE_EQUAL(first->response_code,200);
+  BOOST_REQUIRE(first->raw_json);
+  char* first_json = pt_to_json(first->root,0);
+
+  // the second time the body isn't sent, but the tree is the same
+  pt_response_t* second = pt_session_get(session,url);
+  BOOST_REQUIRE_EQUAL(second->response_code,200);
+  BOOST_REQUIRE(!second->raw_json);
+  BOOST_REQUIRE(second->root != first->root);
+  char* second_json = pt_to_json(second->root,0);
+  BOOST_REQUIRE_EQUAL(string(first_json),string(second_json));
+  free(second_json);
+  pt_free_response(second);
+
+  vector<long> codes;
+  pt_async_get(session,url,collect_code,&codes);
+  pt_session_wait(session);
+  BOOST_REQUIRE_EQUAL(codes.size(),1);
+  BOOST_REQUIRE_EQUAL(codes[0],200);
+
+  // writing the document drops it, and the next read sees the change
+  pt_map_set(first->root,"hot",pt_bool_new(0));
+  pt_free_response(pt_session_put(session,url,first->root));
+  pt_response_t* third = pt_session_get(session,url);
+  BOOST_REQUIRE(third->raw_json);
+  BOOST_REQUIRE_EQUAL(pt_boolean_get(pt_map_get(third->root,"hot")),0);
+  pt_free_response(third);
+  pt_free_response(first);
+  free(first_json);
+
+  // nothing fits in a budget this small
+  pt_session_setopt(session,PT_OPT_CACHE_BYTES,16);
+  pt_response_t* fourth = pt_session_get(session,url);
+  BOOST_REQUIRE(fourth->raw_json);
+  pt_free_response(fourth);
+  pt_session_free(session);
+
+  pt_metrics_t* after = pt_metrics_snapshot();
+  pt_metrics_enable(0);
+  BOOST_REQUIRE_EQUAL(after->counters[PT_COUNTER_CACHE_HITS] - before->counters[PT_COUNTER_CACHE_HITS],2);
+  BOOST_REQUIRE_EQUAL(after->counters[PT_COUNTER_CACHE_MISSES] - before->counters[PT_COUNTER_CACHE_MISSES],3);
+  pt_free_metrics(before);
+  pt_free_metrics(after);
+}
+
+static string read_all(int fd)
+{
+  string contents;
+  char buf[65536];
+  ssize_t n;
+  lseek(fd,0,SEEK_SET);
+  while ((n = read(fd,buf,sizeof(buf))) > 0)
+    contents.append(buf,n);
+  return contents;
+}
+
+BOOST_AUTO_TEST_CASE( test_attachment_fd )
+{
+  pt_response_t* res = pt_put_raw("http://localhost:5984/pt_test/with_attachment","{}",2);
+  BOOST_REQUIRE_EQUAL(res->response_code,201);
+  string rev = pt_string_get(pt_map_get(res->root,"rev"));
+  pt_free_response(res);
+
+  string data;
+  for(int i = 0; i < (1 << 20); i++)
+    data += (char) (i * 7 % 251);
+  FILE* source = tmpfile();
+  fwrite(data.data(),1,data.size(),source);
+  fflush(source);
+
+  for(int use_mmap = 0; use_mmap < 2; use_mmap++) {
+    lseek(fileno(source),0,SEEK_SET);
+    string url = "http://localhost:5984/pt_test/with_attachment/blob?rev=" + rev;
+    res = pt_attachment_put_from_fd(NULL,url.c_str(),fileno(source),"application/octet-stream",use_mmap);
+    BOOST_REQUIRE_EQUAL(res->response_code,201);
+    rev = pt_string_get(pt_map_get(res->root,"rev"));
+    pt_free_response(res);
+
+    FILE* sink = tmpfile();
+    res = pt_attachment_get_to_fd(NULL,"http://localhost:5984/pt_test/with_attachment/blob",fileno(sink));
+    BOOST_REQUIRE_EQUAL(res->response_code,200);
+    BOOST_REQUIRE(!res->raw_json);
+    pt_free_response(res);
+    BOOST_REQUIRE(read_all(fileno(sink)) == data);
+    fclose(sink);
+  }
+  fclose(source);
+
+  // an error is parsed rather than written out
+  FILE* sink = tmpfile();
+  res = pt_attachment_get_to_fd(NULL,"http://localhost:5984/pt_test/with_attachment/missing",fileno(sink));
+  BOOST_REQUIRE_EQUAL(res->response_code,404);
+  BOOST_REQUIRE(pt_map_get(res->root,"error"));
+  BOOST_REQUIRE_EQUAL(read_all(fileno(sink)).size(),0);
+  pt_free_response(res);
+  fclose(sink);
+}
+
+BOOST_AUTO_TEST_CASE( test_arena_parse )
+{
+  const char* url = "http://localhost:5984/pt_test/arena_doc";
+  pt_node_t* doc = pt_map_new();
+  pt_node_t* items = pt_array_new();
+  for(int i = 0; i < 5000; i++) {
+    pt_node_t* item = pt_map_new();
+    pt_map_set(item,"name",pt_string_new("a widget with a longish name"));
+    pt_map_set(item,"n",pt_integer_new(i));
+    pt_map_set(item,"price",pt_double_new(i * 0.5));
+    pt_map_set(item,"gone",pt_null_new());
+    pt_array_push_back(items,item);
+  }
+  pt_map_set(doc,"items",items);
+  pt_free_response(pt_put(url,doc));
+  pt_free_node(doc);
+
+  pt_response_t* plain = pt_get(url);
+  char* expected = pt_to_json(plain->root,0);
+  pt_free_response(plain);
+
+  pt_session_t* session = pt_session_new(1);
+  BOOST_REQUIRE_EQUAL(pt_session_setopt(session,PT_OPT_ARENA_PARSE,1),0);
+  for(int stream = 0; stream < 2; stream++) {
+    pt_session_setopt(session,PT_OPT_STREAM_PARSE,stream);
+    pt_response_t* res = pt_session_get(session,url);
+    BOOST_REQUIRE_EQUAL(res->response_code,200);
+    items = pt_map_get(res->root,"items");
+    BOOST_REQUIRE_EQUAL(pt_array_len(items),5000);
+    BOOST_REQUIRE_EQUAL(pt_integer_get(pt_map_get(pt_array_get(items,4999),"n")),4999);
+    char* json = pt_to_json(res->root,0);
+    BOOST_REQUIRE_EQUAL(string(json),string(expected));
+    free(json);
+
+    // the tree can't be changed or freed piecemeal, and says so
+    BOOST_REQUIRE(pt_is_read_only(res->root) && pt_is_read_only(items));
+    vector<string> warnings;
+    pt_set_log(PT_LOG_WARN,collect_log,&warnings);
+    pt_node_t* value = pt_integer_new(7);
+    pt_map_set(res->root,"_id",value);
+    BOOST_REQUIRE(pt_map_get(res->root,"_id") != value);
+    pt_array_remove(items,pt_array_get(items,0));
+    BOOST_REQUIRE_EQUAL(pt_array_len(items),5000);
+    pt_node_t* additions = pt_map_new();
+    BOOST_REQUIRE(pt_map_update(res->root,additions,0) != 0);
+    pt_set_log(PT_LOG_OFF,NULL,NULL);
+    pt_free_node(additions);
+    pt_free_node(value);
+    BOOST_REQUIRE_EQUAL(warnings.size(),3);
+    BOOST_REQUIRE(warnings[0].find("pt_map_set") == 0);
+    pt_free_node(items);
+    BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"items")),5000);
+
+    // but a copy can
+    pt_node_t* copy = pt_clone(res->root);
+    BOOST_REQUIRE(!pt_is_read_only(copy));
+    pt_map_set(copy,"extra",pt_bool_new(1));
+    BOOST_REQUIRE(pt_boolean_get(pt_map_get(copy,"extra")));
+    pt_free_node(copy);
+    pt_free_response(res);
+  }
+  free(expected);
+  pt_session_free(session);
+}
+
+BOOST_AUTO_TEST_CASE( test_in_situ_strings )
+{
+  const char* url = "http://localhost:5984/pt_test/in_situ_doc";
+  const char* doc = "{\"plain\":\"value\",\"esc\\\"aped\":\"line\\none \\\"quoted\\\" caf\\u00e9 \\\\\","
+    "\"list\":[\"a\",\"\",\"tab\\tbed\"],\"empty\":\"\"}";
+  pt_free_response(pt_put_raw(url,doc,strlen(doc)));
+  pt_response_t* plain = pt_get(url);
+  char* expected = pt_to_json(plain->root,0);
+  pt_free_response(plain);
+
+  pt_session_t* session = pt_session_new(1);
+  BOOST_REQUIRE_EQUAL(pt_session_setopt(session,PT_OPT_IN_SITU_STRINGS,1),0);
+  for(int arena = 0; arena < 2; arena++) {
+    pt_session_setopt(session,PT_OPT_ARENA_PARSE,arena);
+    pt_response_t* res = pt_session_get(session,url);
+    BOOST_REQUIRE_EQUAL(res->response_code,200);
+    BOOST_REQUIRE(!res->raw_json);
+    BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get(res->root,"plain"))),"value");
+    BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get(res->root,"esc\"aped"))),"line\none \"quoted\" caf\xc3\xa9 \\");
+    pt_node_t* list = pt_map_get(res->root,"list");
+    BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_array_get(list,1))),"");
+    BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_array_get(list,2))),"tab\tbed");
+    char* json = pt_to_json(res->root,0);
+    BOOST_REQUIRE_EQUAL(string(json),string(expected));
+    free(json);
+
+    // strings in the body can be replaced and removed like any others
+    pt_map_set(res->root,"plain",pt_string_new("changed"));
+    pt_map_unset(res->root,"empty");
+    if (!arena) {
+      BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get(res->root,"plain"))),"changed");
+      BOOST_REQUIRE(!pt_map_get(res->root,"empty"));
+    }
+    pt_node_t* copy = pt_clone(res->root);
+    pt_free_response(res);
+    BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(copy,"list")),3);
+    pt_free_node(copy);
+  }
+  free(expected);
+  pt_session_free(session);
+}
+
+BOOST_AUTO_TEST_CASE( test_intern_keys )
+{
+  const char* url = "http://localhost:5984/pt_test/intern_doc";
+  const char* doc = "{\"name\":\"first\",\"esc\\\"aped\":1,\"nested\":{\"name\":\"second\"}}";
+  pt_free_response(pt_put_raw(url,doc,strlen(doc)));
+
+  pt_key_t* name = pt_key_intern("name");
+  pt_key_t* escaped = pt_key_intern("esc\"aped");
+  pt_key_t* missing = pt_key_intern("missing");
+  BOOST_REQUIRE(name && name == pt_key_intern("name"));
+
+  pt_session_t* session = pt_session_new(1);
+  BOOST_REQUIRE_EQUAL(pt_session_setopt(session,PT_OPT_INTERN_KEYS,1),0);
+  for(int mode = 0; mode < 4; mode++) {
+    pt_session_setopt(session,PT_OPT_STREAM_PARSE,mode == 1);
+    pt_session_setopt(session,PT_OPT_ARENA_PARSE,mode == 2);
+    pt_session_setopt(session,PT_OPT_IN_SITU_STRINGS,mode == 3);
+    pt_response_t* first = pt_session_get(session,url);
+    pt_response_t* second = pt_session_get(session,url);
+    BOOST_REQUIRE_EQUAL(first->response_code,200);
+    BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get_k(first->root,name))),"first");
+    BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get_k(pt_map_get(first->root,"nested"),name))),"second");
+    BOOST_REQUIRE_EQUAL(pt_integer_get(pt_map_get_k(second->root,escaped)),1);
+    BOOST_REQUIRE(!pt_map_get_k(first->root,missing));
+    BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get(second->root,"name"))),"first");
+
+    // both responses share the one copy of each key
+    const char* first_key = NULL;
+    const char* second_key = NULL;
+    pt_iterator_t* iter = pt_iterator(first->root);
+    while (pt_iterator_next(iter,&first_key) && strcmp(first_key,"name"))
+      ;
+    free(iter);
+    iter = pt_iterator(pt_map_get(second->root,"nested"));
+    pt_iterator_next(iter,&second_key);
+    free(iter);
+    BOOST_REQUIRE(first_key && first_key == second_key);
+
+    // interned keys aren't the map's to free
+    pt_map_unset(first->root,"name");
+    pt_map_set(second->root,"name",pt_string_new("changed"));
+    if (mode != 2) {
+      BOOST_REQUIRE(!pt_map_get_k(first->root,name));
+      BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get_k(second->root,name))),"changed");
+    }
+    pt_free_response(first);
+    pt_free_response(second);
+  }
+  pt_session_free(session);
+
+  // keys of maps built by hand are found too, however many buckets there are
+  pt_node_t* map = pt_map_new();
+  char key[32];
+  for(int i = 0; i < 1000; i++) {
+    snprintf(key,sizeof(key),"key%d",i);
+    pt_map_set(map,key,pt_integer_new(i));
+  }
+  pt_map_set(map,"name",pt_string_new("built"));
+  BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get_k(map,name))),"built");
+  BOOST_REQUIRE_EQUAL(pt_integer_get(pt_map_get_k(map,pt_key_intern("key999"))),999);
+  BOOST_REQUIRE(!pt_map_get_k(map,missing));
+  BOOST_REQUIRE(!pt_map_get_k(map,NULL));
+  // too long to be a field name, so it isn't interned
+  BOOST_REQUIRE(!pt_key_intern(string(200,'k').c_str()));
+  pt_free_node(map);
+}
+
+static int count_rows_callback(pt_node_t* row, void* userdata)
+{
+  int* seen = (int*) userdata;
+  BOOST_REQUIRE(pt_map_get(row,"id"));
+  pt_free_node(row);
+  ++(*seen);
+  return 0;
+}
+
+static int stop_rows_callback(pt_node_t* row, void* userdata)
+{
+  pt_free_node(row);
+  return 1;
+}
+
+BOOST_AUTO_TEST_CASE( test_view_stream )
+{
+  int seen = 0;
+  pt_response_t* res = pt_view_stream(NULL,"http://localhost:5984/pt_test/_all_docs",count_rows_callback,&seen);
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE(seen >= 2);
+  BOOST_REQUIRE_EQUAL(pt_integer_get(pt_map_get(res->root,"total_rows")),seen);
+  BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"rows")),0);
+  pt_free_response(res);
+
+  res = pt_view_stream(NULL,"http://localhost:5984/pt_test/_all_docs",stop_rows_callback,NULL);
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  pt_free_response(res);
+
+  int pulled = 0;
+  pt_view_t* view = pt_view_open(NULL,"http://localhost:5984/pt_test/_all_docs");
+  pt_node_t* row;
+  while ((row = pt_view_next(view))) {
+    BOOST_REQUIRE(pt_map_get(row,"key"));
+    pulled++;
+  }
+  res = pt_view_close(view);
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE_EQUAL(pulled,seen);
+  pt_free_response(res);
+
+  // stopping early isn't a success, and the half read connection isn't reused
+  pt_session_t* session = pt_session_new(1);
+  view = pt_view_open(session,"http://localhost:5984/pt_test/_all_docs");
+  BOOST_REQUIRE(pt_view_next(view));
+  res = pt_view_close(view);
+  BOOST_REQUIRE_EQUAL(res->response_code,500);
+  pt_free_response(res);
+  res = pt_session_get(session,"http://localhost:5984/pt_test/basic");
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE_EQUAL(string(pt_string_get(pt_map_get(res->root,"_id"))),"basic");
+  pt_free_response(res);
+  pt_session_free(session);
+
+  view = pt_view_open(NULL,"http://localhost:5984/pt_no_such_db/_all_docs");
+  BOOST_REQUIRE(!pt_view_next(view));
+  res = pt_view_close(view);
+  BOOST_REQUIRE_EQUAL(res->response_code,404);
+  pt_free_response(res);
+}
+
 // Here we make a new set of json and make sure we get what we expect
 BOOST_AUTO_TEST_CASE( test_mutable_json )
 {
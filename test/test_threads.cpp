@@ -0,0 +1,827 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BOOST_TEST_MAIN
+#include <boost/test/included/unit_test.hpp>
+#include "pillowtalk.h"
+
+using namespace std;
+using namespace boost::unit_test;
+
+// A socket listening on an ephemeral loopback port, which goes in port
+static int listen_loopback(int* port)
+{
+  int listener = socket(AF_INET,SOCK_STREAM,0);
+  struct sockaddr_in addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(listener,(struct sockaddr*) &addr,sizeof(addr));
+  listen(listener,128);
+  socklen_t len = sizeof(addr);
+  getsockname(listener,(struct sockaddr*) &addr,&len);
+  *port = ntohs(addr.sin_port);
+  return listener;
+}
+
+// Wakes the acceptor out of accept and waits for it to finish
+static void stop_listening(int listener, pthread_t acceptor)
+{
+  shutdown(listener,SHUT_RDWR);
+  close(listener);
+  pthread_join(acceptor,NULL);
+}
+
+static string loopback_url(int port, const char* path)
+{
+  char buf[64];
+  snprintf(buf,sizeof(buf),"http://127.0.0.1:%d",port);
+  return string(buf) + path;
+}
+
+/*
+ * A keep-alive HTTP server on an ephemeral port, or a Unix socket, that
+ * answers every request with the same small document, so this test doesn't
+ * need couchdb.
+ */
+struct StandInServer {
+  int listener;
+  int port;
+  int connections;
+  int open_connections;
+  int requests;
+  int gzipped;    // answers sent compressed because the request accepted gzip
+  int delay_ms;   // how long to think before each answer
+  int drop_overlapping; // hang up on requests that come in while another is being thought about
+  int busy;
+  int dropped;
+  pthread_t acceptor;
+
+  StandInServer(int delay_ms = 0) : connections(0), open_connections(0), requests(0), gzipped(0), delay_ms(delay_ms),
+      drop_overlapping(0), busy(0), dropped(0) {
+    listener = listen_loopback(&port);
+    pthread_create(&acceptor,NULL,accept_loop,this);
+  }
+
+  StandInServer(const char* path) : port(0), connections(0), open_connections(0), requests(0), gzipped(0), delay_ms(0),
+      drop_overlapping(0), busy(0), dropped(0) {
+    listener = socket(AF_UNIX,SOCK_STREAM,0);
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path,path,sizeof(addr.sun_path) - 1);
+    unlink(path);
+    bind(listener,(struct sockaddr*) &addr,sizeof(addr));
+    listen(listener,128);
+    pthread_create(&acceptor,NULL,accept_loop,this);
+  }
+
+  // clients have to hang up first
+  ~StandInServer() {
+    stop_listening(listener,acceptor);
+    while (__sync_fetch_and_add(&open_connections,0) > 0)
+      usleep(1000);
+  }
+
+  string url(const char* path) {
+    return loopback_url(port,path);
+  }
+
+  static void* accept_loop(void* data) {
+    StandInServer* server = (StandInServer*) data;
+    int fd;
+    while ((fd = accept(server->listener,NULL,NULL)) >= 0) {
+      __sync_fetch_and_add(&server->connections,1);
+      __sync_fetch_and_add(&server->open_connections,1);
+      Connection* connection = new Connection;
+      connection->server = server;
+      connection->fd = fd;
+      pthread_t conn;
+      pthread_create(&conn,NULL,serve,connection);
+      pthread_detach(conn);
+    }
+    return NULL;
+  }
+
+  struct Connection {
+    StandInServer* server;
+    int fd;
+  };
+
+  static void* serve(void* data) {
+    Connection* connection = (Connection*) data;
+    StandInServer* server = connection->server;
+    int fd = connection->fd;
+    delete connection;
+    const char* body = "{\"ok\":true,\"rows\":[1,2,3]}";
+    char response[256];
+    int response_len = snprintf(response,sizeof(response),
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %d\r\n\r\n%s",
+        (int) strlen(body),body);
+    // the same body through gzip
+    const char gzip_body[] = "\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\xab\x56\xca\xcf\x56\xb2\x2a\x29\x2a\x4d\xd5\x51"
+      "\x2a\xca\x2f\x2f\x56\xb2\x8a\x36\xd4\x31\xd2\x31\x8e\xad\x05\x00\x44\x57\x74\x2a\x1a\x00\x00\x00";
+    char gzip_headers[256];
+    snprintf(gzip_headers,sizeof(gzip_headers),
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Encoding: gzip\r\nContent-Length: %d\r\n\r\n",
+        (int) sizeof(gzip_body) - 1);
+    string gzip_response = string(gzip_headers) + string(gzip_body,sizeof(gzip_body) - 1);
+    string pending;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd,buf,sizeof(buf))) > 0) {
+      pending.append(buf,n);
+      size_t end;
+      // GETs have no body, so each blank line ends a request
+      while ((end = pending.find("\r\n\r\n")) != string::npos) {
+        string headers = pending.substr(0,end);
+        pending.erase(0,end + 4);
+        __sync_fetch_and_add(&server->requests,1);
+        int delay_ms = __sync_fetch_and_add(&server->delay_ms,0);
+        if (delay_ms && server->drop_overlapping && !__sync_bool_compare_and_swap(&server->busy,0,1)) {
+          __sync_fetch_and_add(&server->dropped,1);
+          break;
+        }
+        if (delay_ms)
+          usleep(delay_ms * 1000);
+        if (server->drop_overlapping)
+          __sync_bool_compare_and_swap(&server->busy,1,0);
+        for(size_t i = 0; i < headers.size(); i++)
+          headers[i] = tolower(headers[i]);
+        size_t accept = headers.find("\r\naccept-encoding:");
+        if (accept != string::npos && headers.substr(accept,headers.find("\r\n",accept + 2) - accept).find("gzip") != string::npos) {
+          __sync_fetch_and_add(&server->gzipped,1);
+          if (write(fd,gzip_response.data(),gzip_response.size()) != (ssize_t) gzip_response.size())
+            break;
+        } else if (write(fd,response,response_len) != response_len) {
+          break;
+        }
+      }
+    }
+    close(fd);
+    __sync_fetch_and_sub(&server->open_connections,1);
+    return NULL;
+  }
+};
+
+struct Worker {
+  pt_session_t* session;
+  pthread_barrier_t* start;
+  string url;
+  int requests;
+  int ok;
+};
+
+static void* hammer(void* data)
+{
+  Worker* worker = (Worker*) data;
+  if (worker->start)
+    pthread_barrier_wait(worker->start);
+  for(int i = 0; i < worker->requests; i++) {
+    pt_response_t* res = pt_session_get(worker->session,worker->url.c_str());
+    if (res->response_code == 200 && pt_array_len(pt_map_get(res->root,"rows")) == 3)
+      worker->ok++;
+    pt_free_response(res);
+  }
+  return NULL;
+}
+
+BOOST_AUTO_TEST_CASE( test_threads )
+{
+  pt_init();
+  StandInServer server;
+  const int thread_count = 32;
+  pt_session_t* session = pt_session_new(thread_count);
+  pt_session_setopt(session,PT_OPT_BUFFER_POOL,8);
+
+  const int requests = 100;
+  pthread_t threads[thread_count];
+  Worker workers[thread_count];
+  for(int i = 0; i < thread_count; i++) {
+    workers[i].session = session;
+    workers[i].start = NULL;
+    workers[i].url = server.url("/db/doc");
+    workers[i].requests = requests;
+    workers[i].ok = 0;
+    pthread_create(&threads[i],NULL,hammer,&workers[i]);
+  }
+  for(int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i],NULL);
+    BOOST_REQUIRE_EQUAL(workers[i].ok,requests);
+  }
+
+  // each thread gets its own handle back, and its connection with it, so
+  // there are never more than one per thread
+  BOOST_REQUIRE(server.connections <= thread_count);
+
+  pt_session_free(session);
+  pt_cleanup();
+}
+
+static void count_rows_callback(pt_response_t* res, void* userdata)
+{
+  if (res->response_code == 200 && pt_array_len(pt_map_get(res->root,"rows")) == 3)
+    (*(int*) userdata)++;
+  pt_free_response(res);
+}
+
+BOOST_AUTO_TEST_CASE( test_buffer_pool_off )
+{
+  pt_init();
+  StandInServer server;
+  string url = server.url("/db/doc");
+  pt_session_t* session = pt_session_new(4);
+  pt_session_setopt(session,PT_OPT_BUFFER_POOL,4);
+  pt_free_response(pt_session_get(session,url.c_str()));
+
+  // the pool goes away with requests still queued on it
+  int ok = 0;
+  for(int i = 0; i < 4; i++)
+    BOOST_REQUIRE(pt_async_get(session,url.c_str(),count_rows_callback,&ok));
+  pt_session_setopt(session,PT_OPT_BUFFER_POOL,0);
+  pt_session_wait(session);
+  BOOST_REQUIRE_EQUAL(ok,4);
+
+  pt_response_t* res = pt_session_get(session,url.c_str());
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  pt_free_response(res);
+  pt_session_free(session);
+  pt_cleanup();
+}
+
+BOOST_AUTO_TEST_CASE( test_accept_encoding )
+{
+  pt_init();
+  StandInServer server;
+  string url = server.url("/db/doc");
+  pt_session_t* session = pt_session_new(1);
+  for(int stream = 0; stream < 2; stream++) {
+    pt_session_setopt(session,PT_OPT_STREAM_PARSE,stream);
+    pt_session_setopt(session,PT_OPT_ACCEPT_ENCODING,0);
+    pt_response_t* res = pt_session_get(session,url.c_str());
+    BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"rows")),3);
+    pt_free_response(res);
+    BOOST_REQUIRE_EQUAL(server.gzipped,stream);
+
+    // the server only compresses when asked, and the body comes back decoded
+    pt_session_setopt(session,PT_OPT_ACCEPT_ENCODING,1);
+    res = pt_session_get(session,url.c_str());
+    BOOST_REQUIRE_EQUAL(res->response_code,200);
+    BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"rows")),3);
+    BOOST_REQUIRE_EQUAL(string(res->raw_json,res->raw_json_len),"{\"ok\":true,\"rows\":[1,2,3]}");
+    pt_free_response(res);
+    BOOST_REQUIRE_EQUAL(server.gzipped,stream + 1);
+  }
+  pt_session_free(session);
+  pt_cleanup();
+}
+
+BOOST_AUTO_TEST_CASE( test_coalescing )
+{
+  pt_init();
+  StandInServer server(200);
+  pt_session_t* session = pt_session_new(8);
+  pt_session_setopt(session,PT_OPT_COALESCE_GETS,1);
+
+  const int thread_count = 16;
+  pthread_t threads[thread_count];
+  Worker workers[thread_count];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start,NULL,thread_count);
+  for(int i = 0; i < thread_count; i++) {
+    workers[i].session = session;
+    workers[i].start = &start;
+    workers[i].url = server.url("/db/hot");
+    workers[i].requests = 1;
+    workers[i].ok = 0;
+    pthread_create(&threads[i],NULL,hammer,&workers[i]);
+  }
+  for(int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i],NULL);
+    BOOST_REQUIRE_EQUAL(workers[i].ok,1);
+  }
+  pthread_barrier_destroy(&start);
+
+  // everyone turned up while the first request was still out
+  BOOST_REQUIRE(server.requests < thread_count / 2);
+
+  pt_session_free(session);
+  pt_cleanup();
+}
+
+BOOST_AUTO_TEST_CASE( test_unix_socket )
+{
+  pt_init();
+  char path[64];
+  snprintf(path,sizeof(path),"/tmp/pt_test_%d.sock",(int) getpid());
+  StandInServer server(path);
+  pt_session_t* session = pt_session_new(2);
+  BOOST_REQUIRE_EQUAL(pt_session_set_unix_socket(session,path),0);
+
+  // the host in the url is never looked up
+  for(int i = 0; i < 10; i++) {
+    pt_response_t* res = pt_session_get(session,"http://couchdb.invalid/db/doc");
+    BOOST_REQUIRE_EQUAL(res->response_code,200);
+    BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"rows")),3);
+    pt_free_response(res);
+  }
+  BOOST_REQUIRE_EQUAL(server.requests,10);
+  BOOST_REQUIRE_EQUAL(server.connections,1);
+
+  pt_session_set_unix_socket(session,NULL);
+  pt_response_t* res = pt_session_get(session,"http://couchdb.invalid/db/doc");
+  BOOST_REQUIRE(res->response_code != 200);
+  pt_free_response(res);
+
+  pt_session_free(session);
+  unlink(path);
+  pt_cleanup();
+}
+
+struct Builder {
+  pthread_barrier_t* built;
+  vector<pt_node_t*>* mine;
+  vector<pt_node_t*>* neighbours;
+  int ok;
+};
+
+static void* build_and_free(void* data)
+{
+  Builder* builder = (Builder*) data;
+  for(int i = 0; i < 500; i++) {
+    pt_node_t* doc = pt_map_new();
+    pt_node_t* list = pt_array_new();
+    pt_map_set(doc,"_id",pt_string_new("doc"));
+    pt_map_set(doc,"n",pt_integer_new(i));
+    pt_map_set(doc,"score",pt_double_new(i * 0.5));
+    pt_map_set(doc,"seen",pt_bool_new(i % 2));
+    pt_map_set(doc,"gone",pt_null_new());
+    for(int j = 0; j < 10; j++)
+      pt_array_push_back(list,pt_integer_new(j));
+    pt_map_set(doc,"list",list);
+    builder->mine->push_back(doc);
+  }
+  pthread_barrier_wait(builder->built);
+
+  // the neighbour's nodes go back to the neighbour's slabs
+  for(size_t i = 0; i < builder->neighbours->size(); i++) {
+    pt_node_t* doc = (*builder->neighbours)[i];
+    if (pt_integer_get(pt_map_get(doc,"n")) == (int) i && pt_array_len(pt_map_get(doc,"list")) == 10)
+      builder->ok++;
+    pt_map_unset(doc,"gone");
+    pt_array_remove(pt_map_get(doc,"list"),pt_array_get(pt_map_get(doc,"list"),0));
+    pt_free_node(doc);
+  }
+  return NULL;
+}
+
+BOOST_AUTO_TEST_CASE( test_node_slabs )
+{
+  const int thread_count = 8;
+  // fresh threads each round take over the slabs of the last round's
+  for(int round = 0; round < 4; round++) {
+    pthread_t threads[thread_count];
+    Builder builders[thread_count];
+    vector<pt_node_t*> docs[thread_count];
+    pthread_barrier_t built;
+    pthread_barrier_init(&built,NULL,thread_count);
+    for(int i = 0; i < thread_count; i++) {
+      builders[i].built = &built;
+      builders[i].mine = &docs[i];
+      builders[i].neighbours = &docs[(i + 1) % thread_count];
+      builders[i].ok = 0;
+      pthread_create(&threads[i],NULL,build_and_free,&builders[i]);
+    }
+    for(int i = 0; i < thread_count; i++) {
+      pthread_join(threads[i],NULL);
+      BOOST_REQUIRE_EQUAL(builders[i].ok,500);
+    }
+    pthread_barrier_destroy(&built);
+  }
+}
+
+struct Interner {
+  pt_session_t* session;
+  pthread_barrier_t* start;
+  string url;
+  int id;
+  int ok;
+};
+
+static void* intern_and_get(void* data)
+{
+  Interner* interner = (Interner*) data;
+  pthread_barrier_wait(interner->start);
+  for(int i = 0; i < 100; i++) {
+    // every thread interns the same new keys at about the same time
+    char key[32];
+    snprintf(key,sizeof(key),"field%d",i);
+    pt_key_t* field = pt_key_intern(key);
+    pt_key_t* rows = pt_key_intern("rows");
+    pt_response_t* res = pt_session_get(interner->session,interner->url.c_str());
+    pt_node_t* map = pt_map_new();
+    pt_map_set(map,key,pt_integer_new(interner->id));
+    if (pt_array_len(pt_map_get_k(res->root,rows)) == 3 && pt_integer_get(pt_map_get_k(map,field)) == interner->id)
+      interner->ok++;
+    pt_free_node(map);
+    pt_free_response(res);
+  }
+  return NULL;
+}
+
+BOOST_AUTO_TEST_CASE( test_intern_keys_threads )
+{
+  pt_init();
+  StandInServer server;
+  pt_session_t* session = pt_session_new(8);
+  pt_session_setopt(session,PT_OPT_INTERN_KEYS,1);
+
+  const int thread_count = 8;
+  pthread_t threads[thread_count];
+  Interner interners[thread_count];
+  pthread_barrier_t start;
+  pthread_barrier_init(&start,NULL,thread_count);
+  for(int i = 0; i < thread_count; i++) {
+    interners[i].session = session;
+    interners[i].start = &start;
+    interners[i].url = server.url("/db/doc");
+    interners[i].id = i;
+    interners[i].ok = 0;
+    pthread_create(&threads[i],NULL,intern_and_get,&interners[i]);
+  }
+  for(int i = 0; i < thread_count; i++) {
+    pthread_join(threads[i],NULL);
+    BOOST_REQUIRE_EQUAL(interners[i].ok,100);
+  }
+  pthread_barrier_destroy(&start);
+  BOOST_REQUIRE(pt_key_intern("field7") == pt_key_intern("field7"));
+
+  pt_session_free(session);
+  pt_cleanup();
+}
+
+/*
+ * A continuous _changes feed that sends the one change after since and then
+ * drops the connection mid-stream, the way a restarted server or a proxy
+ * timeout would.
+ */
+struct DroppingFeed {
+  int listener;
+  int port;
+  pthread_mutex_t lock;
+  vector<string> requested; // the since of each request, under lock
+  pthread_t acceptor;
+
+  DroppingFeed() {
+    pthread_mutex_init(&lock,NULL);
+    listener = listen_loopback(&port);
+    pthread_create(&acceptor,NULL,serve,this);
+  }
+
+  ~DroppingFeed() {
+    stop_listening(listener,acceptor);
+    pthread_mutex_destroy(&lock);
+  }
+
+  vector<string> since() {
+    pthread_mutex_lock(&lock);
+    vector<string> copy = requested;
+    pthread_mutex_unlock(&lock);
+    return copy;
+  }
+
+  string url() {
+    return loopback_url(port,"/db");
+  }
+
+  static void* serve(void* data) {
+    DroppingFeed* feed = (DroppingFeed*) data;
+    int fd;
+    while ((fd = accept(feed->listener,NULL,NULL)) >= 0) {
+      string request;
+      char buf[4096];
+      ssize_t n;
+      while (request.find("\r\n\r\n") == string::npos && (n = read(fd,buf,sizeof(buf))) > 0)
+        request.append(buf,n);
+      size_t start = request.find("since=") + 6;
+      string since = request.substr(start,request.find_first_of("& ",start) - start);
+      pthread_mutex_lock(&feed->lock);
+      feed->requested.push_back(since);
+      pthread_mutex_unlock(&feed->lock);
+
+      char change[128], chunk[256];
+      long long seq = atoll(since.c_str()) + 1;
+      snprintf(change,sizeof(change),"{\"seq\":%lld,\"id\":\"doc%lld\",\"changes\":[]}\n",seq,seq);
+      int chunk_len = snprintf(chunk,sizeof(chunk),
+          "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n%x\r\n%s\r\n",
+          (int) strlen(change),change);
+      // no terminating chunk, the feed just stops
+      if (write(fd,chunk,chunk_len) != chunk_len)
+        break;
+      usleep(50000);
+      close(fd);
+    }
+    return NULL;
+  }
+};
+
+static int record_seq_callback(pt_node_t* change, void* userdata)
+{
+  vector<int>* seqs = (vector<int>*) userdata;
+  seqs->push_back(pt_integer_get(pt_map_get(change,"seq")));
+  return seqs->size() == 3;
+}
+
+BOOST_AUTO_TEST_CASE( test_changes_reconnect )
+{
+  pt_init();
+  DroppingFeed feed;
+  vector<int> seqs;
+  // every attempt gets a change through, so a single allowed failure is never used up
+  pt_changes_opts_t opts = {0,0,1000,NULL,1};
+  BOOST_REQUIRE_EQUAL(pt_changes_follow(NULL,feed.url().c_str(),"0",&opts,record_seq_callback,&seqs),0);
+
+  BOOST_REQUIRE_EQUAL(seqs.size(),3u);
+  for(int i = 0; i < 3; i++)
+    BOOST_REQUIRE_EQUAL(seqs[i],i + 1);
+  // each reconnect picks up after the last change seen
+  vector<string> since = feed.since();
+  BOOST_REQUIRE_EQUAL(since.size(),3u);
+  BOOST_REQUIRE_EQUAL(since[0],"0");
+  BOOST_REQUIRE_EQUAL(since[1],"1");
+  BOOST_REQUIRE_EQUAL(since[2],"2");
+
+  // without reconnects the first drop is the end of it
+  seqs.clear();
+  opts.max_reconnects = -1;
+  BOOST_REQUIRE(pt_changes_follow(NULL,feed.url().c_str(),"5",&opts,record_seq_callback,&seqs) != 0);
+  BOOST_REQUIRE_EQUAL(seqs.size(),1u);
+  BOOST_REQUIRE_EQUAL(seqs[0],6);
+
+  // a seq past INT_MAX fails the feed rather than resuming from a wrong one
+  seqs.clear();
+  opts.max_reconnects = 0;
+  BOOST_REQUIRE_EQUAL(pt_changes_follow(NULL,feed.url().c_str(),"2147483647",&opts,record_seq_callback,&seqs),-1);
+  BOOST_REQUIRE(seqs.empty());
+  BOOST_REQUIRE_EQUAL(feed.since().size(),5u);
+  pt_cleanup();
+}
+
+BOOST_AUTO_TEST_CASE( test_hedging_fast_server )
+{
+  pt_init();
+  StandInServer server;
+  pt_session_t* session = pt_session_new(2);
+  pt_session_setopt(session,PT_OPT_HEDGE_PERCENTILE,95);
+  string url = server.url("/db/doc");
+  for(int i = 0; i < 20; i++)
+    pt_free_response(pt_session_get(session,url.c_str()));
+
+  // answers come back in well under a millisecond, which mustn't mean hedging every GET
+  pt_metrics_enable(1);
+  pt_metrics_t* before = pt_metrics_snapshot();
+  for(int i = 0; i < 200; i++) {
+    pt_response_t* res = pt_session_get(session,url.c_str());
+    BOOST_REQUIRE_EQUAL(res->response_code,200);
+    pt_free_response(res);
+  }
+  pt_metrics_t* after = pt_metrics_snapshot();
+  pt_metrics_enable(0);
+  BOOST_REQUIRE(after->counters[PT_COUNTER_HEDGES] - before->counters[PT_COUNTER_HEDGES] < 50);
+  BOOST_REQUIRE(server.requests < 20 + 200 + 50);
+  pt_free_metrics(before);
+  pt_free_metrics(after);
+
+  pt_session_free(session);
+  pt_cleanup();
+}
+
+static void count_ok_callback(pt_response_t* res, void* userdata)
+{
+  if (res->response_code == 200)
+    (*(int*) userdata)++;
+  pt_free_response(res);
+}
+
+BOOST_AUTO_TEST_CASE( test_hedging_failed_copy )
+{
+  pt_init();
+  StandInServer server;
+  server.drop_overlapping = 1;
+  pt_session_t* session = pt_session_new(4);
+  pt_session_setopt(session,PT_OPT_HEDGE_PERCENTILE,95);
+  string url = server.url("/db/doc");
+  for(int i = 0; i < 20; i++)
+    pt_free_response(pt_session_get(session,url.c_str()));
+
+  // the second copy is hung up on straight away, which mustn't beat the slow first one
+  __sync_lock_test_and_set(&server.delay_ms,300);
+  pt_response_t* res = pt_session_get(session,url.c_str());
+  BOOST_REQUIRE_EQUAL(res->response_code,200);
+  BOOST_REQUIRE_EQUAL(pt_array_len(pt_map_get(res->root,"rows")),3);
+  pt_free_response(res);
+  BOOST_REQUIRE(server.dropped >= 1);
+
+  int dropped = server.dropped;
+  int ok = 0;
+  BOOST_REQUIRE(pt_async_get(session,url.c_str(),count_ok_callback,&ok));
+  pt_session_wait(session);
+  BOOST_REQUIRE_EQUAL(ok,1);
+  BOOST_REQUIRE(server.dropped > dropped);
+
+  pt_session_free(session);
+  pt_cleanup();
+}
+
+/*
+ * Answers the first upload on each keep-alive connection and hangs up on
+ * the second once it has read it, the way a server timing out idle
+ * connections catches a client that just reused one.  curl then sends the
+ * request again on a new connection, which means rewinding the body.
+ */
+struct DroppingPutServer {
+  int listener;
+  int port;
+  pthread_mutex_t lock;
+  vector<string> bodies;  // every upload read in full, dropped ones too, under lock
+  int answered;
+  pthread_t acceptor;
+
+  DroppingPutServer() : answered(0) {
+    pthread_mutex_init(&lock,NULL);
+    listener = listen_loopback(&port);
+    pthread_create(&acceptor,NULL,serve,this);
+  }
+
+  ~DroppingPutServer() {
+    stop_listening(listener,acceptor);
+    pthread_mutex_destroy(&lock);
+  }
+
+  string url(const char* path) {
+    return loopback_url(port,path);
+  }
+
+  vector<string> received() {
+    pthread_mutex_lock(&lock);
+    vector<string> copy = bodies;
+    pthread_mutex_unlock(&lock);
+    return copy;
+  }
+
+  // The body of the request at the front of pending, or false if it isn't all there yet
+  static bool take_request(string& pending, string& body) {
+    size_t end = pending.find("\r\n\r\n");
+    if (end == string::npos)
+      return false;
+    string headers = pending.substr(0,end);
+    for(size_t i = 0; i < headers.size(); i++)
+      headers[i] = tolower(headers[i]);
+    size_t length_at = headers.find("content-length:");
+    if (length_at != string::npos) {
+      size_t length = strtoul(headers.c_str() + length_at + 15,NULL,10);
+      if (pending.size() < end + 4 + length)
+        return false;
+      body = pending.substr(end + 4,length);
+      pending.erase(0,end + 4 + length);
+      return true;
+    }
+    // chunked
+    body.clear();
+    size_t at = end + 4;
+    for(;;) {
+      size_t line_end = pending.find("\r\n",at);
+      if (line_end == string::npos)
+        return false;
+      size_t chunk = strtoul(pending.c_str() + at,NULL,16);
+      if (chunk == 0) {
+        if (pending.size() < line_end + 4)
+          return false;
+        pending.erase(0,line_end + 4);
+        return true;
+      }
+      if (pending.size() < line_end + 2 + chunk + 2)
+        return false;
+      body.append(pending,line_end + 2,chunk);
+      at = line_end + 2 + chunk + 2;
+    }
+  }
+
+  static void* serve(void* data) {
+    DroppingPutServer* server = (DroppingPutServer*) data;
+    const char* response = "HTTP/1.1 201 Created\r\nContent-Type: application/json\r\nContent-Length: 11\r\n\r\n{\"ok\":true}";
+    int fd;
+    while ((fd = accept(server->listener,NULL,NULL)) >= 0) {
+      string pending, body;
+      char buf[65536];
+      ssize_t n;
+      int requests = 0;
+      while (requests < 2 && (n = read(fd,buf,sizeof(buf))) > 0) {
+        pending.append(buf,n);
+        while (requests < 2 && take_request(pending,body)) {
+          pthread_mutex_lock(&server->lock);
+          server->bodies.push_back(body);
+          pthread_mutex_unlock(&server->lock);
+          if (++requests == 1) {
+            __sync_fetch_and_add(&server->answered,1);
+            if (write(fd,response,strlen(response)) != (ssize_t) strlen(response))
+              requests = 2;
+          }
+        }
+      }
+      close(fd);
+    }
+    return NULL;
+  }
+};
+
+BOOST_AUTO_TEST_CASE( test_put_resend )
+{
+  pt_init();
+  pt_node_t* doc = pt_map_new();
+  pt_node_t* numbers = pt_array_new();
+  for(int i = 0; i < 2000; i++)
+    pt_array_push_back(numbers,pt_integer_new(i));
+  pt_map_set(doc,"numbers",numbers);
+
+  // plain and gzipped bodies
+  for(int gzip = 0; gzip < 2; gzip++) {
+    DroppingPutServer server;
+    string url = server.url("/db/doc");
+    pt_session_t* session = pt_session_new(1);
+    pt_session_setopt(session,PT_OPT_GZIP_MIN_SIZE,gzip);
+    for(int i = 0; i < 2; i++) {
+      pt_response_t* res = pt_session_put(session,url.c_str(),doc);
+      BOOST_REQUIRE_EQUAL(res->response_code,201);
+      pt_free_response(res);
+    }
+    pt_session_free(session);
+    // the second went out twice, the same both times
+    vector<string> bodies = server.received();
+    BOOST_REQUIRE_EQUAL(bodies.size(),3u);
+    BOOST_REQUIRE(bodies[1] == bodies[2] && bodies[0] == bodies[1]);
+    BOOST_REQUIRE_EQUAL(server.answered,2);
+  }
+
+  // attachments from a file, mapped and read
+  char path[64];
+  snprintf(path,sizeof(path),"/tmp/pt_put_resend_%d",(int) getpid());
+  string content(100000,'x');
+  for(int use_mmap = 0; use_mmap < 2; use_mmap++) {
+    DroppingPutServer server;
+    string url = server.url("/db/doc/file");
+    pt_session_t* session = pt_session_new(1);
+    for(int i = 0; i < 2; i++) {
+      FILE* f = fopen(path,"w");
+      fputs("skipped",f);
+      fwrite(content.data(),1,content.size(),f);
+      fclose(f);
+      int fd = open(path,O_RDONLY);
+      // uploads start wherever the fd is
+      lseek(fd,7,SEEK_SET);
+      pt_response_t* res = pt_attachment_put_from_fd(session,url.c_str(),fd,"text/plain",use_mmap);
+      BOOST_REQUIRE_EQUAL(res->response_code,201);
+      pt_free_response(res);
+      close(fd);
+    }
+    pt_session_free(session);
+    vector<string> bodies = server.received();
+    BOOST_REQUIRE_EQUAL(bodies.size(),3u);
+    for(int i = 0; i < 3; i++)
+      BOOST_REQUIRE(bodies[i] == content);
+  }
+  unlink(path);
+
+  // a pipe can't be read twice, so that resend has to fail
+  {
+    DroppingPutServer server;
+    string url = server.url("/db/doc/file");
+    pt_session_t* session = pt_session_new(1);
+    for(int i = 0; i < 2; i++) {
+      int fds[2];
+      BOOST_REQUIRE_EQUAL(pipe(fds),0);
+      BOOST_REQUIRE_EQUAL(write(fds[1],"piped",5),5);
+      close(fds[1]);
+      pt_response_t* res = pt_attachment_put_from_fd(session,url.c_str(),fds[0],"text/plain",0);
+      BOOST_REQUIRE(i == 0 ? res->response_code == 201 : res->response_code != 201);
+      pt_free_response(res);
+      close(fds[0]);
+    }
+    pt_session_free(session);
+  }
+
+  pt_free_node(doc);
+  pt_cleanup();
+}